@@ -24,6 +24,49 @@
 #include <QRadioButton>
 #include <QGroupBox>
 #include <QTimer>
+#include <QHash>
+#include <QSharedPointer>
+#include <QCache>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QCryptographicHash>
+#include <QMutex>
+#include <QPicture>
+#include <QFutureWatcher>
+#include <QStatusBar>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrentRun>
+#include <QCommandLineParser>
+#include <QCheckBox>
+#include <QPrinterInfo>
+#include <QProgressDialog>
+#include <QQueue>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QDir>
+#include <QPagedPaintDevice>
+#include <QPaintEngine>
+#include <QPainterPath>
+#include <QRawFont>
+#include <QGlyphRun>
+#include <QTextLayout>
+#include <QProcess>
+#include <QTemporaryDir>
+#include <QTemporaryFile>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <cmath>
+#include <complex>
+#ifdef Q_PROCESSOR_X86
+#include <immintrin.h>
+#endif
+#include <memory>
 
 // #define debug_
 
@@ -56,287 +99,1470 @@ namespace Format {
     };
 }
 
-struct Pdf final {
-    QIODevice *device;
-    QPdfWriter *writer{};
-    QPainter painter;
-    int pageNumber = 1;
-    qreal posY = 0;
-    qreal pageHeight = 0;
+// Кэш измерений текста, общий для всех документов потока: метрики шрифта и ширины
+// слов по ключу (семейство, размер, жирный, курсив)
+struct TextMeasureCache final {
+    struct FontKey {
+        QString family;
+        qreal pointSize;
+        bool bold;
+        bool italic;
+
+        bool operator==(const FontKey &o) const {
+            return family == o.family && pointSize == o.pointSize &&
+                   bold == o.bold && italic == o.italic;
+        }
 
-    explicit Pdf(QIODevice *device): device(device) {
-        if (device->isOpen()) {
-            device->close();
+        friend uint qHash(const FontKey &key, const uint seed = 0) {
+            return qHash(key.family, seed) ^ qHash(key.pointSize) ^
+                   (key.bold ? 1u : 0u) ^ (key.italic ? 2u : 0u);
         }
-        if (!device->open(QIODevice::WriteOnly)) {
-            return;
+    };
+
+    struct Font final {
+        QFontMetricsF metrics;
+        qreal spaceWidth;
+        qreal height;
+        QHash<QString, qreal> advances;
+
+        explicit Font(const QFont &font): metrics(font),
+                                          spaceWidth(metrics.horizontalAdvance(
+                                              QLatin1Char(' '))),
+                                          height(metrics.height()) {
         }
-        writer = new QPdfWriter(device);
-        writer->setResolution(300);
+    };
+
+    // Ограничение на число слов одного шрифта, чтобы длинные примечания
+    // с уникальными словами не раздували кэш
+    static constexpr int maxAdvances = 1 << 16;
+
+    QHash<FontKey, QSharedPointer<Font> > fonts;
+    // Счетчики для отладочного вывода
+    std::atomic<quint64> hits{0};
+    std::atomic<quint64> misses{0};
+
+    // Свой экземпляр на поток: измерение слов обходится без блокировок, а потоки
+    // QThreadPool переиспользуются, так что кэш не теряется между отчетами
+    static TextMeasureCache &global() {
+        static thread_local TextMeasureCache cache;
+        return cache;
     }
 
-    void begin() {
-        if (!writer) return;
-        if (!painter.begin(writer)) {
-            device->close();
+    Font &font(const QFont &f) {
+        const FontKey key{f.family(), f.pointSizeF(), f.bold(), f.italic()};
+        auto it = fonts.find(key);
+        if (it == fonts.end()) {
+            it = fonts.insert(key, QSharedPointer<Font>::create(f));
         }
-        const QRectF pageRect = writer->pageLayout().paintRectPixels(writer->resolution());
-        pageHeight = pageRect.height();
+        return **it;
     }
 
-    void end() {
-        if (pageNumber > 1) {
-            drawPageNumber();
+    qreal advance(Font &font, const QString &text, const int begin, const int end) {
+        // Поиск без копирования символов; копия создается только при вставке
+        const QString word = QString::fromRawData(text.constData() + begin, end - begin);
+        const auto it = font.advances.constFind(word);
+        if (it != font.advances.constEnd()) {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return *it;
         }
-        painter.end();
-        device->close();
+        misses.fetch_add(1, std::memory_order_relaxed);
+        const qreal w = font.metrics.horizontalAdvance(word);
+        if (font.advances.size() >= maxAdvances) {
+            font.advances.clear();
+        }
+        font.advances.insert(QString(word.constData(), word.size()), w);
+        return w;
     }
 
-    ~Pdf() {
-        end();
-        // delete writer;
+    qreal advance(Font &font, const QString &text) {
+        return advance(font, text, 0, text.size());
     }
+};
 
-    // размеры в миллиметрах
-    void setPageSize(const int w, const int h) const {
-        if (!writer) return;
-        writer->setPageSize(QPageSize(QSize(w, h), QPageSize::Millimeter, "Report"));
+// Кэш декодированных изображений, общий для процесса. Ключ - путь, время изменения
+// файла и целевая ширина; вытесняются давно не использованные (QCache - LRU),
+// стоимость записи - размер изображения в байтах
+struct ImageCache final {
+    struct Key {
+        QString path;
+        qint64 mtime;
+        int width; // 0 - исходный размер
+
+        bool operator==(const Key &o) const {
+            return width == o.width && mtime == o.mtime && path == o.path;
+        }
+
+        friend uint qHash(const Key &key, const uint seed = 0) {
+            return qHash(key.path, seed) ^ qHash(key.mtime) ^ qHash(key.width);
+        }
+    };
+
+    QCache<Key, QImage> images;
+    std::atomic<quint64> decodes{0}; // читается без mutex (отладочный вывод)
+    QMutex mutex; // отчеты строятся в рабочих потоках
+
+    explicit ImageCache(const int maxBytes = 64 * 1024 * 1024) {
+        images.setMaxCost(maxBytes);
     }
 
-    // размеры в миллиметрах
-    void setMargins(const int l, const int t, const int r, const int b) const {
-        if (!writer) return;
-        auto pdfWriterLayout = writer->pageLayout();
-        pdfWriterLayout.setUnits(QPageLayout::Millimeter);
-        pdfWriterLayout.setMargins(QMarginsF(l, t, r, b));
-        writer->setPageLayout(pdfWriterLayout);
+    static ImageCache &global() {
+        static ImageCache cache;
+        return cache;
     }
 
-    qreal textHeightManualWithNewlines(const QString &text, const qreal width,
-                                       const qreal lineSpacing = 1.5) const {
-        const QFontMetricsF fm(painter.font());
-        const qreal lineHeight = fm.height() * lineSpacing;
-        qreal totalHeight = 0;
+    void setMaxBytes(const int maxBytes) {
+        QMutexLocker locker(&mutex);
+        images.setMaxCost(maxBytes);
+    }
 
-        // Разбиваем текст на параграфы по символам переноса строки
-        QStringList paragraphs = text.split('\n');
+    // width > 0 - изображение, масштабированное по ширине (SmoothTransformation)
+    QImage image(const QString &path, const int width = 0) {
+        const QFileInfo info(path);
+        if (!info.exists()) {
+            return QImage();
+        }
+        QMutexLocker locker(&mutex);
+        return lookup(path, info.lastModified().toMSecsSinceEpoch(), width);
+    }
 
-        for (const QString &paragraph: paragraphs) {
-            if (paragraph.isEmpty()) {
-                // Пустая строка - все равно учитываем высоту
-                totalHeight += lineHeight;
-                continue;
+    QImage lookup(const QString &path, const qint64 mtime, const int width) {
+        const Key key{path, mtime, width};
+        if (const QImage *cached = images.object(key)) {
+            return *cached;
+        }
+        QImage result;
+        if (width > 0) {
+            const QImage original = lookup(path, mtime, 0);
+            if (original.isNull()) {
+                return original;
+            }
+            result = original.scaledToWidth(width, Qt::SmoothTransformation);
+        } else {
+            decodes.fetch_add(1, std::memory_order_relaxed);
+            result = QImage(path);
+            if (result.isNull()) {
+                return result;
             }
+        }
+        // Слишком большое для бюджета изображение QCache не сохранит
+        images.insert(key, new QImage(result), static_cast<int>(result.sizeInBytes()));
+        return result;
+    }
+};
 
-            QStringList words = paragraph.split(' ');
-            QStringList lines;
-            QString currentLine;
+// Строка текста после переноса: полуинтервал [begin, end) в исходной строке
+struct TextLine {
+    int begin;
+    int end;
+};
 
-            // Формируем строки с переносом по словам для каждого параграфа
-            for (const QString &word: words) {
-                if (word.isEmpty()) continue;
+// Перенос по словам за линейное время: ширина каждого слова берется из кэша,
+// ширина строки накапливается, а результатом служат смещения строк в тексте
+struct LineBreaker final {
+    TextMeasureCache &cache;
+    TextMeasureCache::Font &font;
 
-                QString testLine = currentLine.isEmpty() ? word : currentLine + " " + word;
-                if (fm.horizontalAdvance(testLine) <= width || currentLine.isEmpty()) {
-                    currentLine = testLine;
-                } else {
-                    lines.append(currentLine);
-                    currentLine = word;
-                }
+    LineBreaker(TextMeasureCache &cache, const QFont &f): cache(cache), font(cache.font(f)) {
+    }
+
+    LineBreaker(TextMeasureCache &cache, TextMeasureCache::Font &font): cache(cache),
+                                                                        font(font) {
+    }
+
+    // Абзацы разделяются '\n', пустой абзац занимает одну строку
+    QVector<TextLine> breakLines(const QString &text, const qreal width) const {
+        QVector<TextLine> lines;
+        int paragraphBegin = 0;
+        while (paragraphBegin <= text.size()) {
+            int paragraphEnd = text.indexOf(QLatin1Char('\n'), paragraphBegin);
+            if (paragraphEnd < 0) paragraphEnd = text.size();
+            breakParagraph(text, paragraphBegin, paragraphEnd, width, lines);
+            paragraphBegin = paragraphEnd + 1;
+        }
+        return lines;
+    }
+
+    void breakParagraph(const QString &text, const int begin, const int end,
+                        const qreal width, QVector<TextLine> &lines) const {
+        const QChar *data = text.constData();
+        int lineBegin = begin;
+        int lineEnd = -1; // конец последнего слова текущей строки
+        qreal lineWidth = 0;
+        int i = begin;
+        while (i < end) {
+            const int spaceBegin = i;
+            while (i < end && data[i] == QLatin1Char(' ')) ++i;
+            if (i == end) break;
+            const int wordBegin = i;
+            while (i < end && data[i] != QLatin1Char(' ')) ++i;
+            const qreal gap = (wordBegin - spaceBegin) * font.spaceWidth;
+            const qreal w = cache.advance(font, text, wordBegin, i);
+            if (lineEnd < 0) {
+                // Первое слово абзаца ставится всегда, ведущие пробелы учитываются
+                lineWidth = gap + w;
+            } else if (lineWidth + gap + w <= width) {
+                lineWidth += gap + w;
+            } else {
+                lines.append({lineBegin, lineEnd});
+                lineBegin = wordBegin;
+                lineWidth = w;
             }
+            lineEnd = i;
+        }
+        if (lineEnd < 0) {
+            // Пустая строка - все равно учитываем высоту
+            lines.append({begin, end});
+        } else {
+            lines.append({lineBegin, lineEnd});
+        }
+    }
+};
+
+// QPicture с разрешением документа: шрифты записываются в тех же размерах,
+// что и при рисовании прямо в PDF
+struct PagePicture final : public QPicture {
+    int dpi = 300;
+
+protected:
+    int metric(const PaintDeviceMetric m) const override {
+        switch (m) {
+            case PdmDpiX:
+            case PdmDpiY:
+            case PdmPhysicalDpiX:
+            case PdmPhysicalDpiY:
+                return dpi;
+            default:
+                return QPicture::metric(m);
+        }
+    }
+};
+
+// Оформление страницы: колонтитул и водяной знак записываются в QPicture один раз для
+// размера страницы и воспроизводятся на каждой; от страницы зависит только номер,
+// ширина которого складывается из заранее измеренных ширин цифр
+struct PageDecoration final {
+    // Шапка первой страницы (Pdf::header), записывается так же один раз. Логотипы
+    // хранятся отдельно: QPicture сохранил бы их в PNG и распаковывал при каждом выводе
+    struct Header {
+        QVector<QPair<QRectF, QImage> > images; // рисуются до picture
+        QPicture picture; // текст и рамки
+        int height = 0;
+    };
 
-            if (!currentLine.isEmpty()) {
-                lines.append(currentLine);
+    QPicture picture; // неизменная часть, координаты области рисования
+    bool empty = true;
+    QFont numberFont{"Times", 12};
+    qreal digitAdvance[10]{};
+    QPointF numberRight; // правый край и базовая линия номера страницы
+
+    static QSharedPointer<const PageDecoration> get(const QSizeF &pageSize, const int dpi,
+                                                    const QString &footer,
+                                                    const QString &watermark) {
+        static QMutex cacheMutex;
+        static QHash<QString, QSharedPointer<const PageDecoration> > cache;
+        const QString key = QString("%1x%2@%3\n%4\n%5").arg(pageSize.width())
+                .arg(pageSize.height()).arg(dpi).arg(footer, watermark);
+        QMutexLocker locker(&cacheMutex);
+        const auto it = cache.constFind(key);
+        if (it != cache.constEnd()) {
+            return *it;
+        }
+        auto result = QSharedPointer<PageDecoration>::create();
+        // Те же метрики, что у TextMeasureCache
+        const QFontMetricsF metrics(result->numberFont);
+        for (int digit = 0; digit < 10; ++digit) {
+            result->digitAdvance[digit] = metrics.horizontalAdvance(QChar('0' + digit));
+        }
+        result->numberRight = QPointF(pageSize.width() - 20, pageSize.height() + 40);
+        if (!footer.isEmpty() || !watermark.isEmpty()) {
+            PagePicture picture;
+            picture.dpi = dpi;
+            QPainter painter(&picture);
+            if (!watermark.isEmpty()) {
+                QFont font("Times", 72);
+                font.setBold(true);
+                painter.setFont(font);
+                painter.setPen(QColor(225, 225, 225));
+                painter.translate(pageSize.width() / 2, pageSize.height() / 2);
+                painter.rotate(-45);
+                const qreal diagonal = qSqrt(pageSize.width() * pageSize.width() +
+                                             pageSize.height() * pageSize.height());
+                painter.drawText(QRectF(-diagonal / 2, -pageSize.height() / 4, diagonal,
+                                        pageSize.height() / 2), Qt::AlignCenter, watermark);
+                painter.resetTransform();
             }
+            if (!footer.isEmpty()) {
+                QFont font("Times", 10);
+                font.setItalic(true);
+                painter.setFont(font);
+                painter.setPen(Qt::black);
+                painter.drawText(QPointF(0, pageSize.height() + 40), footer);
+            }
+            painter.end();
+            result->picture = picture;
+            result->empty = false;
+        }
+        cache.insert(key, result);
+        return result;
+    }
 
-            totalHeight += lines.count() * lineHeight;
+    void drawNumber(QPainter &painter, const int number) const {
+        const QString text = QString::number(number);
+        qreal width = 0;
+        for (const QChar c: text) {
+            width += digitAdvance[c.unicode() - '0'];
         }
+        painter.setFont(numberFont);
+        painter.drawText(QPointF(numberRight.x() - width, numberRight.y()), text);
+    }
 
-        return totalHeight;
+    // Логотипы шапки; укажите правильные пути к изображениям
+    static QStringList headerLogos() {
+        return {"../Logotype_VS.png", "../CUSTOM.png"};
     }
 
-    qreal calculateTextHeightAdvanced(const QString &text, const qreal width,
-                                      const qreal lineSpacing = 1.5) const {
-        const QFontMetricsF fm(painter.font());
-        const qreal lineHeight = fm.height() * lineSpacing;
-        qreal totalHeight = 0;
+    // Ключ - размер страницы и время изменения логотипов, как у ImageCache: замененный
+    // файл дает новую шапку. Шапка без логотипов (height 0) не кэшируется
+    static QSharedPointer<const Header> header(const QSizeF &pageSize, const int dpi) {
+        static QMutex cacheMutex;
+        static QHash<QString, QSharedPointer<const Header> > cache;
+        QString key = QString("%1x%2@%3").arg(pageSize.width()).arg(pageSize.height()).arg(dpi);
+        for (const QString &logo: headerLogos()) {
+            key += '\n' + QString::number(QFileInfo(logo).lastModified().toMSecsSinceEpoch());
+        }
+        QMutexLocker locker(&cacheMutex);
+        const auto it = cache.constFind(key);
+        if (it != cache.constEnd()) {
+            return *it;
+        }
+        auto result = QSharedPointer<Header>::create();
+        PagePicture picture;
+        picture.dpi = dpi;
+        QPainter painter(&picture);
+        result->height = drawHeader(painter, QRectF(QPointF(), pageSize), result->images);
+        painter.end();
+        result->picture = picture;
+        if (result->height > 0) {
+            cache.insert(key, result);
+        }
+        return result;
+    }
+
+    static int drawHeader(QPainter &painter, const QRectF &pageRect,
+                          QVector<QPair<QRectF, QImage> > &images) {
+        constexpr qreal gapX = 100;
+        painter.setPen(QPen(Qt::black, 1));
+        QFont font("Times", 14); // 12->14 14->16
+        // Масштабируем изображения под ширину страницы (с учетом отступов)
+        const qreal availableWidth = pageRect.width();
+        const int _width = static_cast<int>(availableWidth / 9);
+        const QStringList logos = headerLogos();
+        const QImage scaledImage = ImageCache::global().image(logos[0], _width);
+        if (scaledImage.isNull()) {
+            return 0;
+        }
+        const QImage scaledImage2 = ImageCache::global().image(logos[1], _width);
+        if (scaledImage2.isNull()) {
+            return 0;
+        }
+        const int _height = scaledImage.height();
+        images.append(qMakePair(QRectF(availableWidth - _width, 0, _width, _height), scaledImage));
+        images.append(qMakePair(QRectF(0, 0, _width, _height), scaledImage2));
+        font.setItalic(true);
+        painter.setFont(font);
+        const qreal _mes = (availableWidth - 3 * gapX) / 2 - _width;
+        // drawText(painter, QRectF(availableWidth / 10 + gapX, 0, _mes, _height),
+        // "Справочные данные организации Заказчика");
+        painter.drawText(QRectF(_width + gapX, 0, _mes, _height),
+                         Qt::AlignVCenter | Qt::AlignLeft | Qt::TextWordWrap,
+                         "Справочные данные организации Заказчика");
+        painter.setFont(font);
+        painter.drawText(QRectF(availableWidth / 2 + gapX / 2, 0, _mes, _height),
+                         Qt::AlignVCenter | Qt::AlignRight | Qt::TextWordWrap,
+                         "ООО «ВС Инжиниринг» ©ВС Сигнал. Версия: 1.0.0");
+        font.setItalic(false);
+        //------------------------------------------------------------------------------------
+        painter.drawRect(QRectF(availableWidth / 2 - gapX / 2, 0, gapX, _height));
+        painter.drawRect(QRectF(_width, 0, gapX, _height));
+        painter.drawRect(QRectF(availableWidth - _width, 0, -gapX, _height));
+        painter.setFont(QFont("Arial", 8));
+        painter.drawText(QRectF(0, 0, availableWidth, _height), 0,
+                         QString("%1 x %2").arg(availableWidth).arg(_height));
+        painter.drawRect(QRectF(0, 0, availableWidth, _height));
+        painter.drawRect(QRectF(-mm2p(10), -mm2p(10), mm2p(10), mm2p(10)));
+        painter.drawRect(QRectF(mm2p(50), mm2p(50), mm2p(100), mm2p(100)));
+        painter.drawRect(QRectF(0, 0, pageRect.width(), pageRect.height()));
+        //--------------------------------------------------------------------------------
+        return _height + 20;
+    }
+};
 
-        QStringList paragraphs = text.split('\n');
+// Описание принтера из PPD-файла. Разбираются строки *Ключ Вариант/Перевод: "значение";
+// локализованные ключи (*fr.Ключ) и комментарии (*%) пропускаются. Размеры бумаги -
+// в пунктах (1/72 дюйма), как в PPD
+struct Ppd final {
+    struct Paper {
+        QSizeF size; // *PaperDimension
+        QRectF imageableArea; // *ImageableArea, от левого верхнего угла
 
-        for (const QString &paragraph: paragraphs) {
-            // Учитываем даже полностью пустые параграфы
-            if (paragraph.trimmed().isEmpty()) {
-                totalHeight += lineHeight;
-                continue;
-            }
+        bool isValid() const {
+            return !size.isEmpty();
+        }
 
-            QStringList words = paragraph.split(' ', Qt::SkipEmptyParts);
-            if (words.isEmpty()) {
-                totalHeight += lineHeight;
-                continue;
-            }
+        QSizeF sizeMM() const {
+            return size * 25.4 / 72.0;
+        }
+
+        // Непечатаемые поля, мм
+        QMarginsF marginsMM() const {
+            if (imageableArea.isEmpty()) return {};
+            return QMarginsF(imageableArea.left(), imageableArea.top(),
+                             size.width() - imageableArea.right(),
+                             size.height() - imageableArea.bottom()) * (25.4 / 72.0);
+        }
+    };
 
-            QStringList lines;
-            QString currentLine = words.first();
+    QString modelName;
+    int languageLevel = 2;
+    bool colorDevice = true;
+    int resolution = 300; // *DefaultResolution, dpi
+    // Фрагменты PostScript по ключу и варианту: options["PageSize"]["A4"]
+    QHash<QByteArray, QHash<QByteArray, QByteArray> > options;
+    QHash<QByteArray, QByteArray> defaults; // *DefaultКлюч: вариант
+    QHash<QByteArray, int> orderDependency; // *OrderDependency: порядок AnySetup *Ключ
+    QHash<QByteArray, Paper> papers;
+
+    QByteArray code(const QByteArray &key, const QByteArray &option) const {
+        return options.value(key).value(option);
+    }
 
-            for (int i = 1; i < words.size(); ++i) {
-                const QString &word = words[i];
-                QString testLine = currentLine + " " + word;
+    // Бумага по имени варианта *PageSize; пустое имя - *DefaultPageSize
+    Paper paper(const QByteArray &name = {}) const {
+        return papers.value(name.isEmpty() ? defaults.value("PageSize") : name);
+    }
 
-                if (fm.horizontalAdvance(testLine) <= width) {
-                    currentLine = testLine;
+    static QSharedPointer<Ppd> parse(const QByteArray &data) {
+        auto result = QSharedPointer<Ppd>::create();
+        QHash<QByteArray, QByteArray> areas;
+        QHash<QByteArray, QByteArray> dimensions;
+        int pos = 0;
+        while (pos < data.size()) {
+            int eol = data.indexOf('\n', pos);
+            if (eol < 0) eol = data.size();
+            const int begin = pos;
+            pos = eol + 1;
+            if (data.at(begin) != '*' || (begin + 1 < eol && data.at(begin + 1) == '%')) continue;
+            const int colon = data.indexOf(':', begin);
+            if (colon < 0 || colon > eol) continue;
+            // Значение в кавычках может занимать несколько строк
+            int v = colon + 1;
+            while (v < eol && data.at(v) == ' ') ++v;
+            QByteArray value;
+            if (v < eol && data.at(v) == '"') {
+                const int close = data.indexOf('"', v + 1);
+                if (close < 0) break;
+                value = data.mid(v + 1, close - v - 1);
+                if (close > eol) {
+                    eol = data.indexOf('\n', close);
+                    pos = eol < 0 ? data.size() : eol + 1;
+                }
+            } else {
+                value = data.mid(v, eol - v).trimmed();
+            }
+            const QByteArray head = data.mid(begin + 1, colon - begin - 1);
+            const int space = head.indexOf(' ');
+            const QByteArray key = space < 0 ? head : head.left(space);
+            if (key.contains('.')) continue;
+            if (space >= 0) {
+                QByteArray option = head.mid(space + 1).trimmed();
+                const int slash = option.indexOf('/');
+                if (slash >= 0) option.truncate(slash);
+                if (key == "ImageableArea") {
+                    areas.insert(option, value);
+                } else if (key == "PaperDimension") {
+                    dimensions.insert(option, value);
                 } else {
-                    lines.append(currentLine);
-                    currentLine = word;
+                    result->options[key].insert(option, value);
+                }
+            } else if (key.startsWith("Default")) {
+                result->defaults.insert(key.mid(7), value);
+            } else if (key == "ModelName") {
+                result->modelName = QString::fromLatin1(value);
+            } else if (key == "LanguageLevel") {
+                result->languageLevel = value.toInt();
+            } else if (key == "ColorDevice") {
+                result->colorDevice = value == "True";
+            } else if (key == "OrderDependency") {
+                const QList<QByteArray> parts = value.simplified().split(' ');
+                if (parts.size() >= 3 && parts[2].startsWith('*')) {
+                    result->orderDependency.insert(parts[2].mid(1), parts[0].toInt());
                 }
             }
+        }
+        const int dpi = result->defaults.value("Resolution").toInt();
+        if (dpi > 0) {
+            result->resolution = dpi;
+        }
+        for (auto it = dimensions.constBegin(); it != dimensions.constEnd(); ++it) {
+            const QList<QByteArray> size = it.value().simplified().split(' ');
+            if (size.size() != 2) continue;
+            Paper paper;
+            paper.size = QSizeF(size[0].toDouble(), size[1].toDouble());
+            // llx lly urx ury от левого нижнего угла
+            const QList<QByteArray> area = areas.value(it.key()).simplified().split(' ');
+            if (area.size() == 4) {
+                const qreal llx = area[0].toDouble();
+                const qreal lly = area[1].toDouble();
+                const qreal urx = area[2].toDouble();
+                const qreal ury = area[3].toDouble();
+                paper.imageableArea = QRectF(llx, paper.size.height() - ury, urx - llx, ury - lly);
+            }
+            result->papers.insert(it.key(), paper);
+        }
+        return result;
+    }
+
+    // Разобранные PPD кэшируются по пути
+    static QSharedPointer<const Ppd> load(const QString &path) {
+        static QMutex cacheMutex;
+        static QHash<QString, QSharedPointer<const Ppd> > cache;
+        QMutexLocker locker(&cacheMutex);
+        const auto it = cache.constFind(path);
+        if (it != cache.constEnd()) {
+            return *it;
+        }
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            qWarning() << "Не удалось открыть PPD" << path << file.errorString();
+            return {};
+        }
+        const QSharedPointer<const Ppd> result = parse(file.readAll());
+        cache.insert(path, result);
+        return result;
+    }
+};
 
-            lines.append(currentLine);
-            totalHeight += lines.count() * lineHeight;
+// Движок QPainter, который пишет PostScript level 3 в поток (файл или канал lp).
+// Пути и текст векторные: контур глифа определяется процедурой и вызывается по имени,
+// изображение - сжатым потоком, который хранится в памяти принтера и повторно не
+// передается. Определения собираются в %%BeginSetup, чтобы страницы оставались
+// независимыми (DSC): страницы до конца документа пишутся во временный файл и
+// передаются после пролога. Координаты страницы - пиксели устройства вывода
+// (QPagedPaintDevice::pageLayout, разрешение logicalDpiX)
+struct PsPaintEngine final : public QPaintEngine {
+    struct GlyphKey {
+        QString family;
+        int weight;
+        int style;
+        quint32 glyph;
+
+        bool operator==(const GlyphKey &o) const {
+            return glyph == o.glyph && weight == o.weight && style == o.style &&
+                   family == o.family;
         }
 
-        return totalHeight;
+        friend uint qHash(const GlyphKey &key, const uint seed = 0) {
+            return qHash(key.family, seed) ^ key.weight ^ key.style << 8 ^ key.glyph << 10;
+        }
+    };
+
+    // Контуры глифов хранятся в единицах этого размера шрифта
+    static constexpr qreal glyphUnits = 1000;
+
+    QIODevice *device;
+    const Ppd *ppd = nullptr;
+    QByteArray paper; // вариант *PageSize в PPD
+    QByteArray out; // текущая страница, сбрасывается в spool
+    QByteArray resources; // определения глифов и изображений для %%BeginSetup
+    QTemporaryFile spool;
+    QPageLayout pageLayout;
+    int dpi = 300;
+    int pageCount = 0;
+    int copies = 1; // копии печатает принтер (/NumCopies)
+    bool collate = true;
+    bool clipDirty = false;
+    QHash<GlyphKey, QByteArray> glyphs;
+    // Определение изображения в %%BeginSetup; gray - передано в DeviceGray
+    struct ImageResource {
+        QByteArray name;
+        bool gray;
+    };
+    QHash<QByteArray, ImageResource> images; // cacheKey и прямоугольник источника
+
+    explicit PsPaintEngine(QIODevice *device): QPaintEngine(AllFeatures), device(device) {
     }
 
-    void drawTextWithWordWrap(const QRectF &rect, const int alignmentFlags,
-                              const QString &text) {
-        QTextDocument textDoc;
+    Type type() const override {
+        return PostScript;
+    }
 
-        // Настройка документа
-        textDoc.setDefaultFont(painter.font());
-        textDoc.setTextWidth(rect.width()); // Ключевой параметр для переноса
+    static QByteArray number(const qreal value) {
+        QByteArray s = QByteArray::number(value, 'f', 2);
+        while (s.endsWith('0')) s.chop(1);
+        if (s.endsWith('.')) s.chop(1);
+        return s == "-0" ? QByteArray("0") : s;
+    }
 
-        QTextCursor cursor(&textDoc);
-        QTextBlockFormat blockFormat;
-        blockFormat.setLineHeight(150, QTextBlockFormat::ProportionalHeight);
-        blockFormat.setAlignment(
-            static_cast<Qt::Alignment>(alignmentFlags) | Qt::AlignVCenter);
-        cursor.setBlockFormat(blockFormat);
-        cursor.insertText(text);
+    void flush(const bool force = false) {
+        if (!force && out.size() < 64 * 1024) return;
+        spool.write(out);
+        out.clear();
+    }
 
-        // Отрисовка
-        painter.save();
-        painter.translate(rect.topLeft());
-        textDoc.drawContents(&painter, QRectF(0, 0, rect.width(), rect.height()));
-        painter.restore();
+    bool begin(QPaintDevice *pdev) override {
+        const auto paged = static_cast<QPagedPaintDevice *>(pdev);
+        pageLayout = paged->pageLayout();
+        dpi = pdev->logicalDpiX();
+        pageCount = 0;
+        glyphs.clear();
+        images.clear();
+        resources.clear();
+        out.clear();
+        if (!spool.open() || !spool.resize(0)) {
+            qWarning() << "Не удалось создать временный файл PostScript" << spool.errorString();
+            return false;
+        }
+        beginPage();
+        return true;
     }
 
-    std::pair<QString, QString> splitTextByHeight(const QString &text, const qreal width,
-                                                  const qreal maxHeight,
-                                                  const qreal lineSpacing = 1.5) const {
-        const QFontMetricsF fm(painter.font());
-        const qreal lineHeight = fm.height() * lineSpacing;
-        qreal currentHeight = 0;
+    // Заголовок, пролог и определения, затем страницы из временного файла
+    bool end() override {
+        endPage();
+        out += "%!PS-Adobe-3.0\n"
+                "%%Creator: printer-pdf\n"
+                "%%LanguageLevel: 3\n"
+                "%%Pages: " + QByteArray::number(pageCount) + "\n"
+                "%%EndComments\n"
+                "%%BeginProlog\n"
+                "/m {moveto} bind def /l {lineto} bind def /c {curveto} bind def\n"
+                "/h {closepath} bind def /w {setlinewidth} bind def\n"
+                "/g {setgray} bind def /rg {setrgbcolor} bind def\n"
+                "/G {gsave 3 1 roll translate load exec fill grestore} bind def\n"
+                "%%EndProlog\n"
+                "%%BeginSetup\n";
+        writeSetup();
+        out += resources;
+        out += "%%EndSetup\n";
+        bool ok = device->write(out) == out.size();
+        out.clear();
+        resources.clear();
+        ok = ok && spool.seek(0);
+        while (ok && !spool.atEnd()) {
+            const QByteArray block = spool.read(64 * 1024);
+            ok = !block.isEmpty() && device->write(block) == block.size();
+        }
+        spool.close();
+        const QByteArray trailer = "%%Trailer\n%%EOF\n";
+        return device->write(trailer) == trailer.size() && ok;
+    }
+
+    // Фрагменты setpagedevice из PPD в порядке *OrderDependency. Без PPD размер
+    // листа и подбор копий задаются напрямую
+    void writeSetup() {
+        const QSizeF sheet = sheetSize();
+        const QByteArray numCopies = copies > 1
+                                         ? "<< /NumCopies " + QByteArray::number(copies) +
+                                           " >> setpagedevice\n"
+                                         : QByteArray();
+        if (!ppd) {
+            out += "<< /PageSize [" + number(sheet.width()) + ' ' + number(sheet.height()) +
+                    "] /Collate " + (collate ? "true" : "false") + " >> setpagedevice\n" +
+                    numCopies;
+            return;
+        }
+        QVector<QPair<int, QByteArray> > features;
+        for (const QByteArray &key: {QByteArray("PageSize"), QByteArray("Resolution"),
+                                     QByteArray("Duplex"), QByteArray("ColorModel"),
+                                     QByteArray("Coll")}) {
+            QByteArray option = key == "PageSize" && !paper.isEmpty()
+                                    ? paper
+                                    : ppd->defaults.value(key);
+            if (key == "Coll") {
+                if (copies < 2) continue;
+                option = collate ? "True" : "False";
+            }
+            const QByteArray code = ppd->code(key, option);
+            if (code.isEmpty()) continue;
+            features.append({ppd->orderDependency.value(key),
+                             "[{\n%%BeginFeature: *" + key + ' ' + option + '\n' + code +
+                             "\n%%EndFeature\n} stopped cleartomark\n"});
+        }
+        std::stable_sort(features.begin(), features.end(),
+                         [](const QPair<int, QByteArray> &a, const QPair<int, QByteArray> &b) {
+                             return a.first < b.first;
+                         });
+        for (const auto &feature: features) {
+            out += feature.second;
+        }
+        out += numCopies;
+    }
+
+    // Лист всегда портретный; альбомная страница печатается на нем повернутой
+    QSizeF sheetSize() const {
+        const QSizeF size = pageLayout.fullRectPoints().size();
+        return size.width() > size.height() ? size.transposed() : size;
+    }
+
+    void beginPage() {
+        ++pageCount;
+        out += "%%Page: " + QByteArray::number(pageCount) + ' ' +
+                QByteArray::number(pageCount) + "\ngsave\n";
+        const qreal k = 72.0 / dpi;
+        const QSizeF sheet = sheetSize();
+        const QSizeF size = pageLayout.fullRectPoints().size();
+        // Начало координат - левый верхний угол, ось Y вниз, как у QPdfWriter.
+        // Альбомная страница поворачивается по часовой стрелке (см. Pdf::setPage)
+        if (size.width() > size.height()) {
+            out += "[0 " + number(-k) + ' ' + number(-k) + " 0 " + number(sheet.width()) + ' ' +
+                    number(sheet.height()) + "] concat\n";
+        } else {
+            out += '[' + number(k) + " 0 0 " + number(-k) + " 0 " + number(sheet.height()) +
+                    "] concat\n";
+        }
+        const QRect paintRect = pageLayout.paintRectPixels(dpi);
+        out += number(paintRect.left()) + ' ' + number(paintRect.top()) + " translate\ngsave\n";
+        // Отсечение осталось в состоянии прошлой страницы
+        clipDirty = painter() && painter()->hasClipping();
+    }
 
-        QString firstPart;
-        QString secondPart;
+    void endPage() {
+        out += "grestore grestore showpage\n";
+        flush(true);
+    }
 
-        // Разбиваем текст на параграфы по переносам строк
-        QStringList paragraphs = text.split('\n');
+    void updateState(const QPaintEngineState &newState) override {
+        if (newState.state() & (DirtyClipPath | DirtyClipRegion | DirtyClipEnabled)) {
+            clipDirty = true;
+        }
+    }
 
-        for (int i = 0; i < paragraphs.size(); i++) {
-            const QString &paragraph = paragraphs[i];
+    // Отсечение задается в сохраненном состоянии страницы и сбрасывается grestore
+    void applyClip() {
+        if (!clipDirty) return;
+        clipDirty = false;
+        out += "grestore gsave\n";
+        if (!painter()->hasClipping()) return;
+        const QPainterPath clip = painter()->transform().map(painter()->clipPath());
+        writePath(out, clip, 1);
+        out += clip.fillRule() == Qt::OddEvenFill ? "eoclip newpath\n" : "clip newpath\n";
+    }
 
-            if (paragraph.trimmed().isEmpty()) {
-                // Обработка пустых строк
-                if (currentHeight + lineHeight <= maxHeight) {
-                    if (!firstPart.isEmpty()) firstPart += "\n";
-                    firstPart += paragraph;
-                    currentHeight += lineHeight;
-                } else {
-                    // Добавляем оставшиеся параграфы во вторую часть
-                    if (!secondPart.isEmpty()) secondPart += "\n";
-                    secondPart += paragraph;
-                    for (int j = i + 1; j < paragraphs.size(); j++) {
-                        secondPart += "\n" + paragraphs[j];
+    void writeColor(const QColor &color) {
+        if (color.red() == color.green() && color.green() == color.blue()) {
+            out += number(color.redF()) + " g\n";
+        } else {
+            out += number(color.redF()) + ' ' + number(color.greenF()) + ' ' +
+                    number(color.blueF()) + " rg\n";
+        }
+    }
+
+    // scale - множитель координат перед округлением до двух знаков
+    void writePath(QByteArray &target, const QPainterPath &path, const qreal scale) {
+        int subpathStart = 0;
+        for (int i = 0; i < path.elementCount(); ++i) {
+            const QPainterPath::Element &e = path.elementAt(i);
+            switch (e.type) {
+                case QPainterPath::MoveToElement:
+                    closeSubpath(target, path, subpathStart, i);
+                    subpathStart = i;
+                    target += number(e.x * scale) + ' ' + number(e.y * scale) + " m\n";
+                    break;
+                case QPainterPath::LineToElement:
+                    target += number(e.x * scale) + ' ' + number(e.y * scale) + " l\n";
+                    break;
+                case QPainterPath::CurveToElement:
+                    target += number(e.x * scale) + ' ' + number(e.y * scale);
+                    break;
+                case QPainterPath::CurveToDataElement:
+                    target += ' ' + number(e.x * scale) + ' ' + number(e.y * scale);
+                    if (i + 1 == path.elementCount() ||
+                        path.elementAt(i + 1).type != QPainterPath::CurveToDataElement) {
+                        target += " c\n";
                     }
                     break;
-                }
-                continue;
             }
+        }
+        closeSubpath(target, path, subpathStart, path.elementCount());
+    }
 
-            // Разбиваем параграф на слова
-            QStringList words = paragraph.split(' ', Qt::SkipEmptyParts);
-            if (words.isEmpty()) continue;
-
-            QStringList lines;
-            QString currentLine = words.first();
+    // Замкнутый контур закрывается closepath, иначе у обводки не будет соединения
+    void closeSubpath(QByteArray &target, const QPainterPath &path, const int begin,
+                      const int end) {
+        if (end - begin < 2) return;
+        const QPainterPath::Element &first = path.elementAt(begin);
+        const QPainterPath::Element &last = path.elementAt(end - 1);
+        if (qFuzzyCompare(first.x, last.x) && qFuzzyCompare(first.y, last.y)) {
+            target += "h\n";
+        }
+    }
 
-            // Формируем строки для текущего параграфа
-            for (int j = 1; j < words.size(); j++) {
-                const QString &word = words[j];
-                QString testLine = currentLine + " " + word;
+    void drawPath(const QPainterPath &path, const bool fill, const bool stroke) {
+        applyClip();
+        const QTransform &transform = state->transform();
+        const QPainterPath mapped = transform.map(path);
+        const QBrush brush = state->brush();
+        if (fill && brush.style() != Qt::NoBrush) {
+            writeColor(brush.color());
+            writePath(out, mapped, 1);
+            out += path.fillRule() == Qt::OddEvenFill ? "eofill\n" : "fill\n";
+        }
+        const QPen pen = state->pen();
+        if (stroke && pen.style() != Qt::NoPen) {
+            const qreal width = pen.isCosmetic()
+                                    ? pen.widthF()
+                                    : pen.widthF() * qSqrt(qAbs(transform.determinant()));
+            writeColor(pen.color());
+            out += number(width) + " w\n";
+            writePath(out, mapped, 1);
+            out += "stroke\n";
+        }
+        flush();
+    }
 
-                if (fm.horizontalAdvance(testLine) <= width) {
-                    currentLine = testLine;
-                } else {
-                    lines.append(currentLine);
-                    currentLine = word;
-                }
-            }
-            lines.append(currentLine);
+    void drawPath(const QPainterPath &path) override {
+        drawPath(path, true, true);
+    }
 
-            // Обрабатываем строки параграфа
-            QString paragraphFirstPart;
-            QString paragraphSecondPart;
+    void drawPolygon(const QPointF *points, const int pointCount,
+                     const PolygonDrawMode mode) override {
+        if (pointCount < 2) return;
+        QPainterPath path(points[0]);
+        for (int i = 1; i < pointCount; ++i) {
+            path.lineTo(points[i]);
+        }
+        if (mode != PolylineMode) {
+            path.closeSubpath();
+        }
+        path.setFillRule(mode == WindingMode ? Qt::WindingFill : Qt::OddEvenFill);
+        drawPath(path, mode != PolylineMode, true);
+    }
 
-            for (int j = 0; j < lines.size(); j++) {
-                if (currentHeight + lineHeight <= maxHeight) {
-                    // Строка помещается в первую часть
-                    if (!paragraphFirstPart.isEmpty()) paragraphFirstPart += "\n";
-                    paragraphFirstPart += lines[j];
-                    currentHeight += lineHeight;
-                } else {
-                    // Строка не помещается - переносим во вторую часть
-                    for (int k = j; k < lines.size(); k++) {
-                        if (!paragraphSecondPart.isEmpty()) paragraphSecondPart += "\n";
-                        paragraphSecondPart += lines[k];
+    // Глифы - процедуры /gN с контуром в единицах glyphUnits, текст - их вызовы.
+    // Текст раскладывается QTextLayout, поэтому символы, которых нет в шрифте,
+    // берутся из шрифтов подстановки - отдельными сериями глифов (QGlyphRun)
+    void drawTextItem(const QPointF &p, const QTextItem &textItem) override {
+        const QString text = textItem.text();
+        if (text.isEmpty()) return;
+        applyClip();
+        QTextLayout layout(text, textItem.font(), paintDevice());
+        QTextOption option;
+        option.setWrapMode(QTextOption::NoWrap);
+        layout.setTextOption(option);
+        layout.beginLayout();
+        QTextLine line = layout.createLine();
+        if (line.isValid()) {
+            line.setLineWidth(textItem.width());
+        }
+        layout.endLayout();
+        const QList<QGlyphRun> runs = line.isValid() ? layout.glyphRuns() : QList<QGlyphRun>();
+        if (runs.isEmpty()) {
+            QPaintEngine::drawTextItem(p, textItem);
+            return;
+        }
+        // Ширина из раскладки текста, чтобы выравнивание не отличалось от PDF
+        const qreal natural = line.naturalTextWidth();
+        const qreal stretch = natural > 0 && textItem.width() > 0 ? textItem.width() / natural
+                                                                  : 1;
+
+        // Вызовы глифов в единицах glyphUnits, каждая серия со своим масштабом
+        QByteArray calls;
+        for (const QGlyphRun &run: runs) {
+            const QRawFont rawFont = run.rawFont();
+            const qreal pixelSize = rawFont.pixelSize();
+            if (!rawFont.isValid() || pixelSize <= 0) continue;
+            QRawFont unitFont = rawFont;
+            unitFont.setPixelSize(glyphUnits);
+            const qreal units = glyphUnits / pixelSize;
+            const QVector<quint32> indexes = run.glyphIndexes();
+            const QVector<QPointF> positions = run.positions();
+            QByteArray runCalls;
+            for (int i = 0; i < indexes.size() && i < positions.size(); ++i) {
+                const GlyphKey key{rawFont.familyName(), rawFont.weight(), rawFont.style(),
+                                   indexes[i]};
+                auto it = glyphs.find(key);
+                if (it == glyphs.end()) {
+                    const QPainterPath glyphPath = unitFont.pathForGlyph(indexes[i]);
+                    QByteArray name;
+                    if (!glyphPath.isEmpty()) {
+                        name = "/g" + QByteArray::number(glyphs.size());
+                        resources += name + " {\n";
+                        writePath(resources, glyphPath, 1);
+                        resources += "} def\n";
                     }
-                    break;
+                    it = glyphs.insert(key, name);
+                }
+                if (!it->isEmpty()) {
+                    // Позиции - от начала строки, по вертикали - от базовой линии
+                    runCalls += number(positions[i].x() * stretch * units) + ' ' +
+                            number((positions[i].y() - line.ascent()) * units) + ' ' + *it +
+                            " G\n";
                 }
             }
-
-            // Добавляем обработанный параграф в результат
-            if (!paragraphFirstPart.isEmpty()) {
-                if (!firstPart.isEmpty()) firstPart += "\n";
-                firstPart += paragraphFirstPart;
+            if (!runCalls.isEmpty()) {
+                // Масштаб мелкий, двух знаков number() для него мало
+                calls += "gsave " + QByteArray::number(1 / units, 'g', 6) + " dup scale\n" +
+                        runCalls + "grestore\n";
             }
+        }
+        if (calls.isEmpty()) return;
+        const QTransform &t = state->transform();
+        out += "gsave [" + number(t.m11()) + ' ' + number(t.m12()) + ' ' + number(t.m21()) +
+                ' ' + number(t.m22()) + ' ' + number(t.dx()) + ' ' + number(t.dy()) +
+                "] concat " + number(p.x()) + ' ' + number(p.y()) + " translate\n";
+        writeColor(state->pen().color());
+        out += calls + "grestore\n";
+        flush();
+    }
 
-            if (!paragraphSecondPart.isEmpty()) {
-                if (!secondPart.isEmpty()) secondPart += "\n";
-                secondPart += paragraphSecondPart;
-
-                // Добавляем оставшиеся параграфы во вторую часть
-                for (int j = i + 1; j < paragraphs.size(); j++) {
-                    secondPart += "\n" + paragraphs[j];
+    static QByteArray ascii85(const QByteArray &data) {
+        QByteArray result;
+        result.reserve(data.size() * 5 / 4 + data.size() / 64 + 8);
+        int column = 0;
+        for (int i = 0; i < data.size(); i += 4) {
+            const int n = qMin(4, data.size() - i);
+            quint32 value = 0;
+            for (int j = 0; j < 4; ++j) {
+                value = value << 8 | (j < n ? static_cast<uchar>(data[i + j]) : 0);
+            }
+            if (n == 4 && value == 0) {
+                result += 'z';
+                ++column;
+            } else {
+                char digits[5];
+                for (int j = 4; j >= 0; --j) {
+                    digits[j] = static_cast<char>('!' + value % 85);
+                    value /= 85;
                 }
-                break;
+                result.append(digits, n + 1);
+                column += n + 1;
+            }
+            if (column >= 75) {
+                result += '\n';
+                column = 0;
             }
+        }
+        return result + "~>\n";
+    }
 
-            // Если параграф завершен, но это был последний - выходим
-            if (i == paragraphs.size() - 1) {
-                break;
+    // Изображение передается один раз в %%BeginSetup: распакованные данные остаются в
+    // памяти принтера (ReusableStreamDecode), все вхождения ссылаются на них по имени
+    void drawImage(const QRectF &r, const QImage &image, const QRectF &sr,
+                   Qt::ImageConversionFlags) override {
+        const QRect source = sr.toAlignedRect() & image.rect();
+        if (source.isEmpty()) return;
+        applyClip();
+        const QByteArray cacheKey = QByteArray::number(image.cacheKey()) + ':' +
+                                    QByteArray::number(source.x()) + ',' +
+                                    QByteArray::number(source.y()) + ',' +
+                                    QByteArray::number(source.width()) + 'x' +
+                                    QByteArray::number(source.height());
+        auto it = images.find(cacheKey);
+        if (it == images.end()) {
+            QImage flat = image.copy(source);
+            if (flat.hasAlphaChannel()) {
+                QImage white(flat.size(), QImage::Format_RGB32);
+                white.fill(Qt::white);
+                QPainter(&white).drawImage(0, 0, flat);
+                flat = white;
+            }
+            // Проверка всех пикселей - только при первом вхождении
+            const bool gray = flat.allGray();
+            flat = flat.convertToFormat(gray ? QImage::Format_Grayscale8
+                                             : QImage::Format_RGB888);
+            const int lineBytes = flat.width() * (gray ? 1 : 3);
+            QByteArray samples;
+            samples.reserve(lineBytes * flat.height());
+            for (int y = 0; y < flat.height(); ++y) {
+                samples.append(reinterpret_cast<const char *>(flat.constScanLine(y)), lineBytes);
             }
+            const QByteArray name = "im" + QByteArray::number(images.size());
+            resources += '/' + name + " currentfile /ASCII85Decode filter /FlateDecode filter "
+                    "/ReusableStreamDecode filter\n";
+            // qCompress - 4 байта длины и поток zlib, который понимает FlateDecode
+            resources += ascii85(qCompress(samples, 6).mid(4));
+            resources += "def\n";
+            it = images.insert(cacheKey, {name, gray});
         }
+        const QByteArray &name = it->name;
+        const bool gray = it->gray;
+        const QTransform &t = state->transform();
+        out += "gsave [" + number(t.m11()) + ' ' + number(t.m12()) + ' ' + number(t.m21()) +
+                ' ' + number(t.m22()) + ' ' + number(t.dx()) + ' ' + number(t.dy()) +
+                "] concat " + number(r.x()) + ' ' + number(r.y()) + " translate " +
+                number(r.width()) + ' ' + number(r.height()) + " scale\n";
+        out += gray ? "/DeviceGray setcolorspace " : "/DeviceRGB setcolorspace ";
+        const QByteArray w = QByteArray::number(source.width());
+        const QByteArray h = QByteArray::number(source.height());
+        out += name + " resetfile << /ImageType 1 /Width " + w + " /Height " + h +
+                " /BitsPerComponent 8 /Decode " + (gray ? "[0 1]" : "[0 1 0 1 0 1]") +
+                " /ImageMatrix [" + w + " 0 0 " + h + " 0 0] /DataSource " + name +
+                " >> image\ngrestore\n";
+        flush();
+    }
 
-        return {firstPart, secondPart};
+    void drawPixmap(const QRectF &r, const QPixmap &pixmap, const QRectF &sr) override {
+        drawImage(r, pixmap.toImage(), sr, Qt::AutoColor);
     }
+};
 
-    void addText(const qreal l, const qreal r, const QByteArray &text, const int format) {
-        const auto w = r - l;
-        //
-        {
+// Устройство вывода PostScript с тем же интерфейсом страниц, что у QPdfWriter.
+// Для PPD-принтера в поток попадают его фрагменты setpagedevice (см. writeSetup)
+struct PsWriter final : public QPagedPaintDevice {
+    PsPaintEngine engine;
+    int resolution = 300;
+
+    QT_WARNING_PUSH
+    QT_WARNING_DISABLE_DEPRECATED
+    // Конструктор по умолчанию хранит QPageLayout без привязки к движку - то, что нужно
+    explicit PsWriter(QIODevice *device): engine(device) {
+    }
+    QT_WARNING_POP
+
+    void setPrinter(const Ppd *ppd, const QByteArray &paper) {
+        engine.ppd = ppd;
+        engine.paper = paper;
+    }
+
+    bool newPage() override {
+        if (!engine.isActive()) return false;
+        engine.endPage();
+        engine.beginPage();
+        return true;
+    }
+
+    QPaintEngine *paintEngine() const override {
+        return const_cast<PsPaintEngine *>(&engine);
+    }
+
+protected:
+    int metric(const PaintDeviceMetric m) const override {
+        const QRect paintRect = pageLayout().paintRectPixels(resolution);
+        switch (m) {
+            case PdmWidth:
+                return paintRect.width();
+            case PdmHeight:
+                return paintRect.height();
+            case PdmWidthMM:
+                return qRound(paintRect.width() * 25.4 / resolution);
+            case PdmHeightMM:
+                return qRound(paintRect.height() * 25.4 / resolution);
+            case PdmDpiX:
+            case PdmDpiY:
+            case PdmPhysicalDpiX:
+            case PdmPhysicalDpiY:
+                return resolution;
+            case PdmNumColors:
+                return INT_MAX;
+            case PdmDepth:
+                return 32;
+            case PdmDevicePixelRatio:
+                return 1;
+            case PdmDevicePixelRatioScaled:
+                return static_cast<int>(devicePixelRatioFScale());
+            default:
+                return QPagedPaintDevice::metric(m);
+        }
+    }
+};
+
+struct Pdf final {
+    // Изображение, выведенное при записи снимка. QPicture сохраняет QImage в PNG,
+    // поэтому картинки хранятся рядом со страницей и рисуются после ее записи
+    struct RecordedImage {
+        QTransform transform;
+        bool clipped;
+        QPainterPath clip;
+        QRectF rect;
+        QImage image;
+    };
+
+    // Состояние документа после неизменной части отчета. Страницы хранятся как
+    // QPicture и воспроизводятся в новом документе без повторной разметки
+    struct Snapshot {
+        QVector<QPicture> pages; // последняя - текущая незавершенная страница
+        QVector<QVector<RecordedImage>> images; // изображения страниц pages
+        int pageNumber = 1;
+        qreal posY = 0;
+        QFont font;
+    };
+
+    // Формат вывода: PDF (QPdfWriter) или PostScript для принтера (PsWriter)
+    enum Output { PdfOutput, PostScriptOutput };
+
+    // Готовое оформление текста для сочетания битов Format
+    struct CellStyle {
+        QFont font;
+        TextMeasureCache::Font *metrics = nullptr; // метрики экрана, как у LineBreaker
+        int alignment = 0; // флаги Qt для drawTextWithWordWrap
+        QTextCharFormat charFormat; // фрагмент addParagraph: кегль * 3
+    };
+
+    QIODevice *device;
+    QPagedPaintDevice *writer{};
+    QPainter painter;
+    int pageNumber = 1;
+    qreal posY = 0;
+    qreal pageHeight = 0;
+    TextMeasureCache *measureCache = &TextMeasureCache::global();
+    ImageCache *imageCache = &ImageCache::global();
+    // Общие изображения: одинаковые по содержимому картинки рисуются одним и тем же
+    // QImage, а QPdfEngine кэширует объекты изображений по QImage::cacheKey(),
+    // поэтому в файл попадает одна копия на все вхождения
+    bool shareImages = true;
+    QHash<qint64, QImage> sharedByKey;
+    QHash<QByteArray, QImage> sharedByHash;
+    // Фоновая генерация: флаг отмены и уведомление о каждой завершенной странице
+    const std::atomic_bool *cancelled = nullptr;
+    std::function<void(int)> pageDone;
+    // Запись страниц в QPicture вместо PDF (см. beginRecording)
+    bool recording = false;
+    PagePicture recordedPage;
+    QVector<QPicture> recordedPages;
+    // Запись снимка: изображения не попадают в QPicture (см. RecordedImage)
+    bool imagesAside = false;
+    QVector<RecordedImage> recordedImages;
+    QVector<QVector<RecordedImage>> recordedPageImages;
+    // Только запись страниц, без PDF: begin() и resume() начинают запись, а end()
+    // оставляет все страницы в recordedPages (векторная печать)
+    bool recordOnly = false;
+    // Оформление страниц (см. PageDecoration): колонтитул и водяной знак из шаблона
+    QString footerText;
+    QString watermarkText;
+    QSharedPointer<const PageDecoration> decoration;
+    QPicture decorationPicture;
+    // Стили по format & (styleCount - 1); строятся по мере обращения и сбрасываются
+    // при смене базового шрифта документа
+    static constexpr int styleCount = Format::Small * 2;
+    QFont styleBase;
+    QVector<CellStyle> styles;
+
+    explicit Pdf(QIODevice *device, const Output output = PdfOutput): device(device) {
+        if (device->isOpen()) {
+            device->close();
+        }
+        if (!device->open(QIODevice::WriteOnly)) {
+            return;
+        }
+        if (output == PostScriptOutput) {
+            const auto ps = new PsWriter(device);
+            ps->resolution = 300;
+            writer = ps;
+        } else {
+            const auto pdf = new QPdfWriter(device);
+            pdf->setResolution(300);
+            writer = pdf;
+        }
+    }
+
+    // decorate = false - первая страница уже оформлена (продолжение снимка, см. resume)
+    void begin(const bool decorate = true) {
+        if (!writer) return;
+        if (recordOnly) {
+            beginRecording(decorate);
+            return;
+        }
+        if (!painter.begin(writer)) {
+            device->close();
+        }
+        const QRectF pageRect = writer->pageLayout().paintRectPixels(resolution());
+        pageHeight = pageRect.height();
+        setupDecoration();
+        if (decorate) decoratePage();
+    }
+
+    // Вместо begin(): страницы записываются в QPicture до вызова snapshot().
+    // imagesAside - изображения сохраняются отдельно от страниц (только для снимка)
+    void beginRecording(const bool decorate = true, const bool imagesAside = false) {
+        if (!writer) return;
+        recording = true;
+        this->imagesAside = imagesAside;
+        recordedPages.clear();
+        recordedImages.clear();
+        recordedPageImages.clear();
+        recordedPage = PagePicture();
+        recordedPage.dpi = resolution();
+        painter.begin(&recordedPage);
+        const QRectF pageRect = writer->pageLayout().paintRectPixels(resolution());
+        pageHeight = pageRect.height();
+        setupDecoration();
+        if (decorate) decoratePage();
+    }
+
+    // Завершает запись и возвращает снимок; вывод продолжается после resume()
+    Snapshot snapshot() {
+        Snapshot result;
+        result.font = painter.font();
+        painter.end();
+        result.pages = recordedPages;
+        result.pages.append(recordedPage);
+        result.images = recordedPageImages;
+        result.images.append(recordedImages);
+        result.pageNumber = pageNumber;
+        result.posY = posY;
+        recording = false;
+        imagesAside = false;
+        recordedPages.clear();
+        recordedImages.clear();
+        recordedPageImages.clear();
+        return result;
+    }
+
+    // Вместо begin(): страницы снимка воспроизводятся в PDF, состояние восстанавливается
+    void resume(const Snapshot &snapshot) {
+        if (recordOnly) {
+            beginRecording(false);
+            const int last = snapshot.pages.size() - 1;
+            for (int i = 0; i < last; ++i) {
+                recordedPages.append(snapshotPage(snapshot, i));
+            }
+            if (last >= 0) {
+                painter.drawPicture(0, 0, copyPicture(snapshot.pages[last]));
+                drawImages(painter, snapshot.images.value(last));
+            }
+        } else {
+            begin(false);
+            for (int i = 0; i < snapshot.pages.size() && !isCancelled(); ++i) {
+                if (i > 0) {
+                    writer->newPage();
+                    if (pageDone) pageDone(i);
+                }
+                painter.drawPicture(0, 0, copyPicture(snapshot.pages[i]));
+                drawImages(painter, snapshot.images.value(i));
+            }
+        }
+        pageNumber = snapshot.pageNumber;
+        posY = snapshot.posY;
+        painter.setFont(snapshot.font);
+    }
+
+    // QPicture::play использует внутренний буфер, поэтому снимок, общий для
+    // нескольких потоков, воспроизводится из собственной копии
+    static QPicture copyPicture(const QPicture &picture) {
+        QPicture copy;
+        copy.setData(picture.data(), picture.size());
+        return copy;
+    }
+
+    // Изображения снимка поверх воспроизведенной страницы. Они оказываются выше
+    // векторов своей страницы, выведенных после них (в отчете это только рамки ячеек)
+    void drawImages(QPainter &target, const QVector<RecordedImage> &images) {
+        for (const RecordedImage &item : images) {
+            target.save();
+            target.setWorldTransform(item.transform);
+            if (item.clipped) target.setClipPath(item.clip);
+            target.drawImage(item.rect, sharedImage(item.image));
+            target.restore();
+        }
+    }
+
+    // Страница снимка одной записью вместе с изображениями (векторная печать)
+    QPicture snapshotPage(const Snapshot &snapshot, const int index) {
+        const QVector<RecordedImage> images = snapshot.images.value(index);
+        if (images.isEmpty()) return copyPicture(snapshot.pages[index]);
+        PagePicture page;
+        page.dpi = resolution();
+        QPainter pagePainter(&page);
+        pagePainter.drawPicture(0, 0, copyPicture(snapshot.pages[index]));
+        drawImages(pagePainter, images);
+        pagePainter.end();
+        return page;
+    }
+
+    // false - движок не смог дописать документ (например, PsPaintEngine::end)
+    bool end() {
+        if (!painter.isActive()) return true;
+        if (pageNumber > 1) {
+            drawPageNumber();
+        }
+        const bool ok = painter.end();
+        if (recording) {
+            recordedPages.append(recordedPage);
+            recording = false;
+        }
+        device->close();
+        if (pageDone && !isCancelled()) pageDone(pageNumber);
+        return ok;
+    }
+
+    bool isCancelled() const {
+        return cancelled && cancelled->load(std::memory_order_relaxed);
+    }
+
+    ~Pdf() {
+        end();
+        // delete writer;
+    }
+
+    // размеры в миллиметрах
+    void setPageSize(const QSizeF &size) const {
+        if (!writer) return;
+        writer->setPageSize(QPageSize(size, QPageSize::Millimeter, "Report"));
+    }
+
+    // размеры в миллиметрах
+    void setMargins(const QMarginsF &margins) const {
+        if (!writer) return;
+        auto pdfWriterLayout = writer->pageLayout();
+        pdfWriterLayout.setUnits(QPageLayout::Millimeter);
+        pdfWriterLayout.setMargins(margins);
+        writer->setPageLayout(pdfWriterLayout);
+    }
+
+    // Разрешение страницы: единица разметки - пиксель этого разрешения
+    int resolution() const {
+        return writer ? writer->logicalDpiX() : 300;
+    }
+
+    // Страница размером с бумагу из PPD; поля не меньше непечатаемых. Альбомная
+    // страница печатается на портретном листе, повернутая по часовой стрелке
+    // (см. PrintBatch::orient), поэтому ее левое поле - верхнее поле листа
+    void setPage(const Ppd &ppd, const QByteArray &paperName, const QMarginsF &margins,
+                 const bool landscape) const {
+        const Ppd::Paper paper = ppd.paper(paperName);
+        if (const auto ps = dynamic_cast<PsWriter *>(writer)) {
+            ps->setPrinter(&ppd, paperName);
+        }
+        QSizeF size = paper.sizeMM();
+        QMarginsF hardware = paper.marginsMM();
+        if (landscape) {
+            size.transpose();
+            hardware = QMarginsF(hardware.top(), hardware.right(), hardware.bottom(),
+                                 hardware.left());
+        }
+        setPageSize(size);
+        setMargins(QMarginsF(qMax(margins.left(), hardware.left()),
+                             qMax(margins.top(), hardware.top()),
+                             qMax(margins.right(), hardware.right()),
+                             qMax(margins.bottom(), hardware.bottom())));
+    }
+
+    qreal textHeightManualWithNewlines(const QString &text, const qreal width,
+                                       const qreal lineSpacing = 1.5) const {
+        return calculateTextHeightAdvanced(text, width, lineSpacing);
+    }
+
+    qreal calculateTextHeightAdvanced(const QString &text, const qreal width,
+                                      const qreal lineSpacing = 1.5) const {
+        const LineBreaker breaker(*measureCache, painter.font());
+        const qreal lineHeight = breaker.font.height * lineSpacing;
+        return breaker.breakLines(text, width).size() * lineHeight;
+    }
+
+    void drawTextWithWordWrap(const QRectF &rect, const int alignmentFlags,
+                              const QString &text) {
+        QTextDocument textDoc;
+
+        // Настройка документа
+        textDoc.setDefaultFont(painter.font());
+        textDoc.setTextWidth(rect.width()); // Ключевой параметр для переноса
+
+        QTextCursor cursor(&textDoc);
+        QTextBlockFormat blockFormat;
+        blockFormat.setLineHeight(150, QTextBlockFormat::ProportionalHeight);
+        blockFormat.setAlignment(
+            static_cast<Qt::Alignment>(alignmentFlags) | Qt::AlignVCenter);
+        cursor.setBlockFormat(blockFormat);
+        cursor.insertText(text);
+
+        // Отрисовка
+        painter.save();
+        painter.translate(rect.topLeft());
+        textDoc.drawContents(&painter, QRectF(0, 0, rect.width(), rect.height()));
+        painter.restore();
+    }
+
+    // firstHeight (если задан) получает высоту первой части
+    std::pair<QString, QString> splitTextByHeight(const QString &text, const qreal width,
+                                                  const qreal maxHeight,
+                                                  const qreal lineSpacing = 1.5,
+                                                  qreal *firstHeight = nullptr,
+                                                  TextMeasureCache::Font *metrics = nullptr)
+    const {
+        const LineBreaker breaker = metrics ? LineBreaker(*measureCache, *metrics)
+                                            : LineBreaker(*measureCache, painter.font());
+        const qreal lineHeight = breaker.font.height * lineSpacing;
+        const QVector<TextLine> lines = breaker.breakLines(text, width);
+
+        // Сколько строк помещается в maxHeight
+        int count = 0;
+        qreal currentHeight = 0;
+        while (count < lines.size() && currentHeight + lineHeight <= maxHeight) {
+            currentHeight += lineHeight;
+            ++count;
+        }
+        if (firstHeight) *firstHeight = currentHeight;
+
+        if (count == lines.size()) {
+            return {text, QString()};
+        }
+        if (count == 0) {
+            return {QString(), text};
+        }
+        return {text.left(lines[count - 1].end), text.mid(lines[count].begin)};
+    }
+
+    // Стиль ячейки: поиск в таблице вместо сборки QFont на каждую ячейку
+    const CellStyle &style(const int format) {
+        const QFont base = painter.font();
+        if (styles.isEmpty() || base != styleBase) {
+            styleBase = base;
+            styles = QVector<CellStyle>(styleCount);
+        }
+        CellStyle &result = styles[format & (styleCount - 1)];
+        if (result.metrics) return result;
+        using namespace Format;
+        result.font = base;
+        result.font.setPointSize(format & Small ? 12 : 14);
+        if (format & Italic) result.font.setItalic(true);
+        if (format & Bold) result.font.setBold(true);
+        result.metrics = &measureCache->font(result.font);
+
+        int alignment = Qt::TextWordWrap; // Всегда включаем перенос слов
+        // Вертикальное выравнивание
+        switch (format & 3) {
+            case AlignTop: alignment |= Qt::AlignTop;
+                break;
+            case AlignVCenter: alignment |= Qt::AlignVCenter;
+                break;
+            case AlignBottom: alignment |= Qt::AlignBottom;
+                break;
+            default:
+                alignment |= Qt::AlignBaseline;
+        }
+        // Горизонтальное выравнивание
+        switch (format & 12) {
+            case AlignLeft: alignment |= Qt::AlignLeft;
+                break;
+            case AlignHCenter: alignment |= Qt::AlignHCenter;
+                break;
+            case AlignRight: alignment |= Qt::AlignRight;
+                break;
+            default:
+                alignment |= Qt::AlignJustify;
+        }
+        result.alignment = alignment;
+
+        result.charFormat.setFont(base);
+        if (format & Italic) result.charFormat.setFontItalic(true);
+        if (format & Bold) result.charFormat.setFontWeight(QFont::Bold);
+        result.charFormat.setFontPointSize((format & Small ? 12 : 14) * 3);
+        return result;
+    }
+
+    void addText(const qreal l, const qreal r, const QByteArray &text, const int format) {
+        const auto w = r - l;
+        //
+        {
             QString t = text;
-            using namespace Format;
             const QFont defaultFont = painter.font();
-            QFont font = painter.font();
-            font.setPointSize(format & Small ? 12 : 14);
-            if (format & Italic) font.setItalic(true);
-            if (format & Bold) font.setBold(true);
-            painter.setFont(font);
+            const CellStyle &cellStyle = style(format);
+            // newPage() может сменить шрифт и перестроить таблицу стилей
+            TextMeasureCache::Font *const metrics = cellStyle.metrics;
+            painter.setFont(cellStyle.font);
             do {
-                auto p = splitTextByHeight(t, w, pageHeight - posY);
-                const auto h = calculateTextHeightAdvanced(p.first, w);
+                qreal h = 0;
+                auto p = splitTextByHeight(t, w, pageHeight - posY, 1.5, &h, metrics);
                 drawTextWithWordWrap(QRectF(l, posY, w, h), Qt::AlignLeft, t);
 #ifdef debug_
                 QD << DUMP(p.first) << DUMP(p.second) << DUMP(h) << DUMP(w);
@@ -348,11 +1574,9 @@ struct Pdf final {
                 if (t.size() > 0) {
                     newPage();
                 }
-            } while (t.size() > 0);
+            } while (t.size() > 0 && !isCancelled());
             // Восстанавливаем стандартный шрифт
-            if (format & Italic || format & Bold) {
-                painter.setFont(defaultFont);
-            }
+            painter.setFont(defaultFont);
         }
     }
 
@@ -360,11 +1584,23 @@ struct Pdf final {
                      const QVector<int> &formats, const qreal maxRowHeight = -1,
                      const bool drawGrid = false, const bool print_this_page = false) {
         // Проверка корректности входных данных
-        if (borders.size() < 2 || contents.size() != borders.size() - 1 ||
-            contents.size() != formats.size()) {
+        if (isCancelled() || !isValidRow(borders, contents, formats)) {
             return;
         }
+        drawTableRow(borders, contents, formats,
+                     tableRowHeight(borders, contents, formats, maxRowHeight),
+                     drawGrid, print_this_page);
+    }
+
+    static bool isValidRow(const QVector<qreal> &borders, const QVector<QByteArray> &contents,
+                           const QVector<int> &formats) {
+        return borders.size() >= 2 && contents.size() == borders.size() - 1 &&
+               contents.size() == formats.size();
+    }
 
+    // Высота строки таблицы при текущем шрифте, без отрисовки
+    qreal tableRowHeight(const QVector<qreal> &borders, const QVector<QByteArray> &contents,
+                         const QVector<int> &formats, const qreal maxRowHeight = -1) const {
         const int cellCount = contents.size();
 
         // Рассчитываем высоты всех ячеек
@@ -376,7 +1612,7 @@ struct Pdf final {
 
             if (formats[i] & 64) {
                 // Картинка
-                QImage image(contents[i]);
+                const QImage image = imageCache->image(contents[i]);
                 if (!image.isNull()) {
                     // Масштабируем изображение по ширине ячейки
                     QSizeF scaledSize = image.size().scaled(static_cast<int>(cellWidth),
@@ -396,9 +1632,17 @@ struct Pdf final {
         }
 
         // Определяем итоговую высоту строки
-        const qreal rowHeight = maxRowHeight > 0
-                                    ? qMin(maxRowHeight, actualMaxHeight)
-                                    : actualMaxHeight;
+        return maxRowHeight > 0 ? qMin(maxRowHeight, actualMaxHeight) : actualMaxHeight;
+    }
+
+    // Отрисовка строки таблицы заранее измеренной высоты
+    void drawTableRow(const QVector<qreal> &borders, const QVector<QByteArray> &contents,
+                      const QVector<int> &formats, const qreal rowHeight,
+                      const bool drawGrid = false, const bool print_this_page = false) {
+        if (isCancelled() || !isValidRow(borders, contents, formats)) {
+            return;
+        }
+        const int cellCount = contents.size();
 
         // Проверяем, помещается ли строка на текущей странице
         if (posY + rowHeight > pageHeight && !print_this_page) {
@@ -407,7 +1651,8 @@ struct Pdf final {
 
             // Проверяем, помещается ли на новой странице
             if (rowHeight > pageHeight) {
-                // Не помещается даже на пустой странице - не выводим
+                // Не помещается даже на пустой странице - режется по строкам текста
+                splitTableRow(borders, contents, formats, drawGrid);
                 return;
             }
         }
@@ -425,7 +1670,7 @@ struct Pdf final {
                 using namespace Format;
                 if (format & Picture) {
                     // Картинка
-                    QImage image(content);
+                    const QImage image = imageCache->image(content);
                     if (!image.isNull()) {
                         // Масштабируем изображение
                         QSizeF scaledSize = image.size().scaled(
@@ -455,60 +1700,27 @@ struct Pdf final {
                             y += rowHeight - scaledSize.height();
                         }
 
-                        painter.drawImage(
-                            QRectF(x, y, scaledSize.width(), scaledSize.height()),
-                            image);
+                        drawImage(QRectF(x, y, scaledSize.width(), scaledSize.height()),
+                                  content, image);
                     }
                 } else {
                     // Текст
                     QString text = content;
 
                     // Устанавливаем стиль шрифта
-                    QFont defaultFont = painter.font();
-                    QFont font = painter.font();
-                    font.setPointSize(format & Small ? 12 : 14);
-                    if (format & Italic) font.setItalic(true);
-                    if (format & Bold) font.setBold(true);
-                    painter.setFont(font);
-
-                    // Определяем флаги выравнивания для текста
-                    int textAlignment = Qt::TextWordWrap; // Всегда включаем перенос слов
-
-                    // Вертикальное выравнивание
-                    switch (format & 3) {
-                        case AlignTop: textAlignment |= Qt::AlignTop;
-                            break;
-                        case AlignVCenter: textAlignment |= Qt::AlignVCenter;
-                            break;
-                        case AlignBottom: textAlignment |= Qt::AlignBottom;
-                            break;
-                        default:
-                            textAlignment |= Qt::AlignBaseline;
-                    }
-
-                    // Горизонтальное выравнивание
-                    switch (format & 12) {
-                        case AlignLeft: textAlignment |= Qt::AlignLeft;
-                            break;
-                        case AlignHCenter: textAlignment |= Qt::AlignHCenter;
-                            break;
-                        case AlignRight: textAlignment |= Qt::AlignRight;
-                            break;
-                        default:
-                            textAlignment |= Qt::AlignJustify;
-                    }
+                    const QFont defaultFont = painter.font();
+                    const CellStyle &cellStyle = style(format);
+                    painter.setFont(cellStyle.font);
 
                     // Рисуем текст с выравниванием и переносом
                     if (format & VUse) {
-                        painter.drawText(cellRect, textAlignment, text);
+                        painter.drawText(cellRect, cellStyle.alignment, text);
                     } else {
-                        drawTextWithWordWrap(cellRect, textAlignment, text);
+                        drawTextWithWordWrap(cellRect, cellStyle.alignment, text);
                     }
 
                     // Восстанавливаем стандартный шрифт
-                    if (format & Italic || format & Bold) {
-                        painter.setFont(defaultFont);
-                    }
+                    painter.setFont(defaultFont);
                 }
             }
             // Отладочная рамка вокруг ячейки
@@ -525,11 +1737,62 @@ struct Pdf final {
         posY += rowHeight;
     }
 
+    void splitTableRow(const QVector<qreal> &borders, const QVector<QByteArray> &contents,
+                       const QVector<int> &formats, bool drawGrid);
+
+    QImage sharedImage(const QImage &image) {
+        if (!shareImages || image.isNull()) return image;
+        const auto known = sharedByKey.constFind(image.cacheKey());
+        if (known != sharedByKey.constEnd()) {
+            return *known;
+        }
+        // Содержимое хешируется один раз для каждого нового QImage
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        const int header[3] = {image.width(), image.height(), image.format()};
+        hash.addData(reinterpret_cast<const char *>(header), sizeof(header));
+        const QVector<QRgb> colors = image.colorTable();
+        hash.addData(reinterpret_cast<const char *>(colors.constData()),
+                     colors.size() * static_cast<int>(sizeof(QRgb)));
+        // Построчно: выравнивание в конце строки может быть не инициализировано
+        const int lineBytes = (image.width() * image.depth() + 7) / 8;
+        for (int y = 0; y < image.height(); ++y) {
+            hash.addData(reinterpret_cast<const char *>(image.constScanLine(y)), lineBytes);
+        }
+        const QByteArray digest = hash.result();
+        auto it = sharedByHash.find(digest);
+        if (it == sharedByHash.end()) {
+            it = sharedByHash.insert(digest, image);
+        }
+        sharedByKey.insert(image.cacheKey(), *it);
+        return *it;
+    }
+
+    void drawImage(const QRectF &rect, const QImage &image) {
+        if (imagesAside) {
+            recordedImages.append({painter.worldTransform(), painter.hasClipping(),
+                                   painter.hasClipping() ? painter.clipPath() : QPainterPath(),
+                                   rect, image});
+            return;
+        }
+        painter.drawImage(rect, sharedImage(image));
+    }
+
+    // Картинка ячейки для вывода в rect: уменьшенная копия берется из кэша по целевой
+    // ширине, так что сглаженное масштабирование выполняется один раз на размер.
+    // Увеличение остается устройству - исходник и так меньше места в документе
+    void drawImage(const QRectF &rect, const QString &path, const QImage &original) {
+        const int width = qCeil(rect.width());
+        drawImage(rect, width > 0 && width < original.width()
+                            ? imageCache->image(path, width)
+                            : original);
+    }
+
     void addParagraph(const qreal left, const qreal right, const QVector<QByteArray> &lines,
                       const QVector<int> &formats, const qreal lineSpacing = 1.5,
                       const bool drawBorders = false) {
         // Проверяем корректность входных данных
-        if (lines.isEmpty() || left >= right || lines.size() != formats.size()) {
+        if (isCancelled() || lines.isEmpty() || left >= right ||
+            lines.size() != formats.size()) {
             return;
         }
 
@@ -550,16 +1813,8 @@ struct Pdf final {
         for (int i = 0; i < lines.size(); ++i) {
             QString text = lines[i];
 
-            // Создаем формат для текущего фрагмента текста
-            QTextCharFormat charFormat;
-            charFormat.setFont(painter.font());
-
-            if (formats[i] & Format::Italic) charFormat.setFontItalic(true);
-            if (formats[i] & Format::Bold) charFormat.setFontWeight(QFont::Bold);
-            charFormat.setFontPointSize((formats[i] & Format::Small ? 12 : 14) * 3);
-
-            // Вставляем текст с заданным форматом
-            cursor.insertText(text, charFormat);
+            // Вставляем текст с форматом фрагмента
+            cursor.insertText(text, style(formats[i]).charFormat);
         }
 
         // Получаем общую высоту документа
@@ -632,11 +1887,11 @@ struct Pdf final {
         // }
         text += QString("\npdfWriter.units: %1").arg(writer->pageLayout().units());
         const auto pdfWriterRect = writer->pageLayout().pageSize().rectPixels(
-            writer->resolution());
+            resolution());
         text += QString("\npdfWriter.pageSize: %1 %2").arg(pdfWriterRect.width()).arg(
             pdfWriterRect.height());
         const QRectF pageRect = writer->pageLayout().
-                paintRectPixels(writer->resolution());
+                paintRectPixels(resolution());
         text += QString("\npageRect: left=%1 top=%2 width=%3 height=%4")
                 .arg(pageRect.left())
                 .arg(pageRect.top())
@@ -674,7 +1929,7 @@ struct Pdf final {
         document.setDefaultTextOption(textOption);
 
         // Устанавливаем размер страницы
-        const QRectF pageRect = writer->pageLayout().paintRectPixels(writer->resolution());
+        const QRectF pageRect = writer->pageLayout().paintRectPixels(resolution());
         document.setPageSize(pageRect.size());
         document.setDocumentMargin(0);
 
@@ -698,7 +1953,7 @@ struct Pdf final {
         cursor.setBlockFormat(newFormat);
 
         const QRectF pageRect = writer->pageLayout().
-                paintRectPixels(writer->resolution());
+                paintRectPixels(resolution());
         for (int i = 0; i < pageCount; ++i) {
             if (i > 0) {
                 newPage();
@@ -716,96 +1971,2319 @@ struct Pdf final {
     }
 
     int header(const QRectF *pageRect) {
-        constexpr qreal gapX = 100;
-        painter.setPen(QPen(Qt::black, 1));
-        QFont font("Times", 14); // 12->14 14->16
-        // Загружаем изображение
-        const QImage image("../Logotype_VS.png"); // Укажите правильный путь к изображению
-        if (image.isNull()) {
-            return 0;
+        const auto recorded = PageDecoration::header(pageRect->size(), resolution());
+        if (recorded->height > 0) {
+            // Те же QImage при каждом вызове: sharedImage узнает их по cacheKey
+            for (const auto &image : recorded->images) {
+                drawImage(image.first, image.second);
+            }
+            painter.drawPicture(0, 0, copyPicture(recorded->picture));
         }
-        // Загружаем изображение
-        const QImage image2("../CUSTOM.png"); // Укажите правильный путь к изображению
-        if (image2.isNull()) {
-            return 0;
+        return recorded->height;
+    }
+
+    void startPagination() {
+        pageNumber = 1;
+    }
+
+    void drawPageNumber() {
+        if (!writer || !decoration) return;
+        const auto f = painter.font();
+        decoration->drawNumber(painter, pageNumber);
+        painter.setFont(f);
+    }
+
+    // Оформление для текущей геометрии страницы; вызывается в начале документа
+    void setupDecoration() {
+        const QRectF pageRect = writer->pageLayout().paintRectPixels(resolution());
+        decoration = PageDecoration::get(pageRect.size(), resolution(), footerText,
+                                         watermarkText);
+        // Своя копия: QPicture::play не допускает общего воспроизведения из потоков
+        decorationPicture = decoration->empty ? QPicture()
+                                              : copyPicture(decoration->picture);
+    }
+
+    // Неизменная часть оформления, рисуется первой на каждой странице
+    void decoratePage() {
+        if (!decoration || decoration->empty) return;
+        painter.drawPicture(0, 0, decorationPicture);
+    }
+
+    void newPage() {
+        if (!writer || isCancelled()) return;
+        drawPageNumber();
+        if (recording) {
+            const QFont font = painter.font();
+            painter.end();
+            recordedPages.append(recordedPage);
+            recordedPageImages.append(recordedImages);
+            recordedImages.clear();
+            recordedPage = PagePicture();
+            recordedPage.dpi = resolution();
+            painter.begin(&recordedPage);
+            painter.setFont(font);
+        } else {
+            writer->newPage();
         }
-        // Масштабируем изображение под ширину страницы (с учетом отступов)
-        const qreal availableWidth = pageRect->width();
-        const int _width = static_cast<int>(availableWidth / 9);
-        const QImage scaledImage = image.scaledToWidth(_width, Qt::SmoothTransformation);
-        const int _height = scaledImage.height();
-        const QImage scaledImage2 = image2.scaledToWidth(_width, Qt::SmoothTransformation);
-        painter.drawImage(QRectF(availableWidth - _width, 0, _width, _height), scaledImage);
-        painter.drawImage(QRectF(0, 0, _width, _height), scaledImage2);
-        font.setItalic(true);
-        painter.setFont(font);
-        const qreal _mes = (availableWidth - 3 * gapX) / 2 - _width;
-        // drawText(painter, QRectF(availableWidth / 10 + gapX, 0, _mes, _height),
-        // "Справочные данные организации Заказчика");
-        painter.drawText(QRectF(_width + gapX, 0, _mes, _height),
-                         Qt::AlignVCenter | Qt::AlignLeft | Qt::TextWordWrap,
-                         "Справочные данные организации Заказчика");
+        decoratePage();
+        if (pageDone) pageDone(pageNumber);
+        pageNumber++;
+        posY = 0;
+    }
+
+    qreal width() const {
+        if (!writer) return 0;
+        return writer->width();
+    }
+
+    void setFont(const QFont &font) {
+        if (!writer) return;
         painter.setFont(font);
-        painter.drawText(QRectF(availableWidth / 2 + gapX / 2, 0, _mes, _height),
-                         Qt::AlignVCenter | Qt::AlignRight | Qt::TextWordWrap,
-                         "ООО «ВС Инжиниринг» ©ВС Сигнал. Версия: 1.0.0");
-        font.setItalic(false);
-        //------------------------------------------------------------------------------------
-        painter.drawRect(QRectF(availableWidth / 2 - gapX / 2, 0, gapX, _height));
-        painter.drawRect(QRectF(_width, 0, gapX, _height));
-        painter.drawRect(QRectF(availableWidth - _width, 0, -gapX, _height));
-        painter.setFont(QFont("Arial", 8));
-        painter.drawText(QRectF(0, 0, availableWidth, _height), 0,
-                         QString("%1 x %2").arg(availableWidth).arg(_height));
-        painter.drawRect(QRectF(0, 0, availableWidth, _height));
-        painter.drawRect(QRectF(-mm2p(10), -mm2p(10), mm2p(10), mm2p(10)));
-        painter.drawRect(QRectF(mm2p(50), mm2p(50), mm2p(100), mm2p(100)));
-        painter.drawRect(QRectF(0, 0, pageRect->width(), pageRect->height()));
-        //--------------------------------------------------------------------------------
-        return _height + 20;
     }
 
-    void startPagination() {
-        pageNumber = 1;
+    void skip(const qreal i) {
+        posY += i;
+    }
+};
+
+// Таблица, которая выводится целиком: строки подаются по одной (addRow), измеряются
+// сразу и раскладываются по страницам за один проход. Строки измеряются так же, как
+// Pdf::tableRowHeight (текущий шрифт, метрики экрана, шаг 1.5 высоты шрифта), а ячейки
+// рисуются так же, как Pdf::drawTableRow. Все строки текста таблицы имеют общий шаг,
+// поэтому строку выше страницы можно разрезать между строками текста.
+// Заголовок повторяется на каждой странице. Страница рисуется по столбцам - шрифт
+// меняется один раз на столбец, - а в памяти хранятся только строки текущей страницы.
+// Готовые страницы остаются за Pdf: при записи в файл они сразу уходят в устройство
+struct TableLayout final {
+    struct Row {
+        QVector<QString> cells;
+        QVector<QVector<TextLine> > lines; // по ячейкам; у картинки пусто
+        QVector<qreal> imageHeights;
+        int lineCount = 0;
+        qreal height = 0;
+    };
+
+    // Часть строки на странице: строки текста [firstLine, firstLine + lineCount)
+    struct Slice {
+        int row; // индекс в rows; -1 - заголовок
+        int firstLine;
+        int lineCount;
+        qreal y;
+        qreal height;
+    };
+
+    Pdf &doc;
+    QVector<qreal> borders;
+    QVector<int> formats;
+    QVector<int> headerFormats;
+    bool grid = true;
+    QVector<QFont> fonts; // по столбцам
+    QVector<int> alignments;
+    QVector<QFont> headerFonts;
+    QVector<int> headerAlignments;
+    TextMeasureCache::Font *metrics = nullptr;
+    qreal pitch = 0; // шаг строк текста
+    Row header;
+    bool hasHeader = false;
+    QVector<Row> rows; // строки текущей страницы
+    QVector<Slice> slices;
+    int rowCount = 0;
+
+    // headerCells пусто - таблица без заголовка; headerFormats по умолчанию -
+    // форматы столбцов с полужирным шрифтом
+    TableLayout(Pdf &doc, const QVector<qreal> &borders, const QVector<int> &formats,
+                const QVector<QByteArray> &headerCells = {},
+                const QVector<int> &headerFormats = {}): doc(doc), borders(borders),
+                                                         formats(formats),
+                                                         headerFormats(headerFormats) {
+        if (this->headerFormats.isEmpty()) {
+            for (const int format: formats) {
+                this->headerFormats.append(format | Format::Bold);
+            }
+        }
+        for (int i = 0; i < formats.size(); ++i) {
+            const Pdf::CellStyle &style = doc.style(formats[i]);
+            fonts.append(style.font);
+            alignments.append(style.alignment);
+            const Pdf::CellStyle &headerStyle = doc.style(this->headerFormats.value(i));
+            headerFonts.append(headerStyle.font);
+            headerAlignments.append(headerStyle.alignment);
+        }
+        metrics = &doc.measureCache->font(doc.painter.font());
+        pitch = metrics->height * 1.5;
+        if (!headerCells.isEmpty() && headerCells.size() == formats.size()) {
+            header = measure(headerCells, this->headerFormats);
+            hasHeader = true;
+            // Заголовок не остается один внизу страницы
+            if (doc.posY + header.height + pitch > doc.pageHeight) {
+                doc.newPage();
+            }
+            placeHeader();
+        }
+    }
+
+    ~TableLayout() {
+        finish();
+    }
+
+    bool isValid() const {
+        return borders.size() >= 2 && formats.size() == borders.size() - 1 && pitch > 0;
+    }
+
+    Row measure(const QVector<QByteArray> &cells, const QVector<int> &cellFormats) const {
+        Row row;
+        row.cells.reserve(cells.size());
+        row.lines.resize(cells.size());
+        row.imageHeights.resize(cells.size());
+        for (int i = 0; i < cells.size(); ++i) {
+            const qreal width = borders[i + 1] - borders[i];
+            if (cellFormats[i] & Format::Picture) {
+                row.cells.append(QString::fromUtf8(cells[i]));
+                const QImage image = doc.imageCache->image(row.cells.last());
+                if (!image.isNull()) {
+                    row.imageHeights[i] = image.size().scaled(static_cast<int>(width),
+                                                              image.height(),
+                                                              Qt::KeepAspectRatio).height();
+                    row.height = qMax(row.height, row.imageHeights[i]);
+                }
+                continue;
+            }
+            row.cells.append(QString::fromUtf8(cells[i]));
+            const LineBreaker breaker(*doc.measureCache, *metrics);
+            row.lines[i] = breaker.breakLines(row.cells.last(), width);
+            row.lineCount = qMax(row.lineCount, row.lines[i].size());
+        }
+        row.height = qMax(row.height, row.lineCount * pitch);
+        return row;
+    }
+
+    void placeHeader() {
+        if (!hasHeader) return;
+        slices.append({-1, 0, header.lineCount, doc.posY, header.height});
+        doc.posY += header.height;
+    }
+
+    void addRow(const QVector<QByteArray> &cells) {
+        if (!isValid() || cells.size() != formats.size() || doc.isCancelled()) return;
+        Row row = measure(cells, formats);
+        ++rowCount;
+        const qreal height = row.height;
+        const qreal bodyHeight = doc.pageHeight - (hasHeader ? header.height : 0);
+        // Строка, которая помещается на пустую страницу, не разрезается
+        if (doc.posY + height > doc.pageHeight &&
+            (height <= bodyHeight || doc.pageHeight - doc.posY < pitch)) {
+            breakPage(false);
+        }
+        rows.append(row);
+        if (doc.posY + height <= doc.pageHeight) {
+            slices.append({rows.size() - 1, 0, row.lineCount, doc.posY, height});
+            doc.posY += height;
+            return;
+        }
+        // Строка выше страницы: режется по строкам текста
+        int firstLine = 0;
+        bool freshPage = slices.isEmpty() || slices.last().row < 0;
+        while (!doc.isCancelled()) {
+            const Row &current = rows.last();
+            const qreal available = doc.pageHeight - doc.posY;
+            int fit = static_cast<int>(available / pitch);
+            if (fit < 1) {
+                if (!freshPage) {
+                    // Строка текста не помещается до низа страницы
+                    breakPage(true);
+                    freshPage = true;
+                    continue;
+                }
+                // Под заголовком не помещается ни одной строки даже на новой странице
+                fit = 1;
+            }
+            const int count = qMin(fit, current.lineCount - firstLine);
+            const qreal rest = current.height - firstLine * pitch;
+            const bool last = firstLine + count >= current.lineCount;
+            const qreal sliceHeight = last ? qMin(rest, available) : count * pitch;
+            slices.append({rows.size() - 1, firstLine, count, doc.posY, sliceHeight});
+            doc.posY += sliceHeight;
+            firstLine += count;
+            if (last) break;
+            breakPage(true);
+            freshPage = true;
+        }
+    }
+
+    // Выводит накопленную страницу и начинает следующую; keepLast - последняя строка
+    // не выведена до конца и переходит на новую страницу
+    void breakPage(const bool keepLast) {
+        drawSlices();
+        const Row last = keepLast ? rows.last() : Row();
+        rows.clear();
+        slices.clear();
+        if (keepLast) {
+            rows.append(last);
+        }
+        doc.newPage();
+        placeHeader();
+    }
+
+    void drawSlices() {
+        QPainter &painter = doc.painter;
+        const QFont defaultFont = painter.font();
+        painter.setPen(QPen(Qt::black, 1));
+        for (int column = 0; column + 1 < borders.size(); ++column) {
+            for (int pass = 0; pass < 2; ++pass) {
+                // Сначала заголовок (его шрифт), затем строки данных
+                const bool isHeader = pass == 0;
+                if (isHeader && !hasHeader) continue;
+                painter.setFont(isHeader ? headerFonts[column] : fonts[column]);
+                const int format = (isHeader ? headerFormats : formats)[column];
+                const int alignment = (isHeader ? headerAlignments : alignments)[column];
+                for (const Slice &slice: slices) {
+                    if ((slice.row < 0) != isHeader) continue;
+                    drawCell(isHeader ? header : rows[slice.row], slice, column, format,
+                             alignment);
+                }
+            }
+        }
+        painter.setFont(defaultFont);
+#ifndef debug_
+        if (grid)
+#endif
+        {
+            for (const Slice &slice: slices) {
+                for (int column = 0; column + 1 < borders.size(); ++column) {
+                    painter.drawRect(QRectF(borders[column], slice.y,
+                                            borders[column + 1] - borders[column], slice.height));
+                }
+            }
+        }
+    }
+
+    void drawCell(const Row &row, const Slice &slice, const int column, const int format,
+                  const int alignment) {
+        using namespace Format;
+        const qreal left = borders[column];
+        const qreal width = borders[column + 1] - left;
+        if (format & Picture) {
+            if (slice.firstLine > 0 || row.imageHeights[column] <= 0) return;
+            const QImage image = doc.imageCache->image(row.cells[column]);
+            const QSizeF size = image.size().scaled(static_cast<int>(width),
+                                                    static_cast<int>(slice.height),
+                                                    Qt::KeepAspectRatio);
+            doc.drawImage(QRectF(left + (width - size.width()) / 2, slice.y, size.width(),
+                                 size.height()), row.cells[column], image);
+            return;
+        }
+        const QVector<TextLine> &lines = row.lines[column];
+        const int end = qMin(lines.size(), slice.firstLine + slice.lineCount);
+        if (slice.firstLine >= end) return;
+        // Строки текста этой части, выведенные тем же путем, что и в drawTableRow
+        const QString &text = row.cells[column];
+        const int begin = lines[slice.firstLine].begin;
+        const QString part = slice.firstLine == 0 && end == lines.size()
+                                 ? text
+                                 : text.mid(begin, lines[end - 1].end - begin);
+        const QRectF rect(left, slice.y, width, slice.height);
+        if (format & VUse) {
+            doc.painter.drawText(rect, alignment, part);
+        } else {
+            doc.drawTextWithWordWrap(rect, alignment, part);
+        }
+    }
+
+    void finish() {
+        if (slices.isEmpty()) return;
+        drawSlices();
+        rows.clear();
+        slices.clear();
+    }
+
+    // Вся таблица сразу
+    static void render(Pdf &doc, const QVector<qreal> &borders, const QVector<int> &formats,
+                       const QVector<QByteArray> &headerCells,
+                       const QVector<QVector<QByteArray> > &rows) {
+        TableLayout table(doc, borders, formats, headerCells);
+        for (const auto &row: rows) {
+            table.addRow(row);
+        }
+        table.finish();
+    }
+};
+
+// Источник строк таблицы для TableLayout: строки читаются по одной, так что в памяти
+// только текущая строка источника и строки текущей страницы таблицы
+struct TableSource {
+    virtual ~TableSource() = default;
+
+    // false - строки кончились
+    virtual bool next(QVector<QByteArray> &cells) = 0;
+};
+
+// CSV (RFC 4180): поля в кавычках могут содержать разделитель, кавычки ("") и
+// переводы строк. Файл читается построчно через буфер QFile
+struct CsvTableSource final : public TableSource {
+    QFile file;
+    char separator;
+
+    CsvTableSource(const QString &path, const char separator): file(path),
+                                                                separator(separator) {
+        if (!file.open(QIODevice::ReadOnly)) {
+            qWarning() << "Не удалось открыть таблицу" << path << file.errorString();
+        }
+    }
+
+    bool next(QVector<QByteArray> &cells) override {
+        cells.clear();
+        QByteArray field;
+        bool quoted = false;
+        bool any = false;
+        while (file.isOpen()) {
+            const QByteArray line = file.readLine();
+            if (line.isEmpty()) break;
+            // Пустая строка файла вне кавычек - не строка таблицы
+            if (!quoted && (line == "\n" || line == "\r\n")) continue;
+            any = true;
+            for (int i = 0; i < line.size(); ++i) {
+                const char c = line.at(i);
+                if (quoted) {
+                    if (c != '"') {
+                        field += c;
+                    } else if (i + 1 < line.size() && line.at(i + 1) == '"') {
+                        field += '"';
+                        ++i;
+                    } else {
+                        quoted = false;
+                    }
+                } else if (c == '"') {
+                    quoted = true;
+                } else if (c == separator) {
+                    cells.append(field);
+                    field.clear();
+                } else if (c != '\r' && c != '\n') {
+                    field += c;
+                }
+            }
+            // Поле в кавычках продолжается на следующей строке файла
+            if (!quoted) break;
+        }
+        if (!any) return false;
+        cells.append(field);
+        return true;
+    }
+};
+
+// Двоичный файл записей фиксированного размера (значения в порядке байт машины).
+// Файл отображается в память окнами по windowBytes; прочитанное окно освобождается,
+// поэтому резидентная память не растет с размером файла
+struct BinaryTableSource final : public TableSource {
+    enum Type { Int16, Int32, Float32, Float64 };
+
+    static constexpr qint64 windowBytes = 16 << 20;
+
+    QFile file;
+    QVector<Type> columns;
+    int recordSize = 0;
+    int precision = 3;
+    qint64 position = 0;
+    qint64 end = 0;
+    uchar *window = nullptr;
+    qint64 windowBegin = 0;
+    qint64 windowSize = 0;
+
+    static int typeSize(const Type type) {
+        switch (type) {
+            case Int16: return 2;
+            case Int32: return 4;
+            case Float32: return 4;
+            default: return 8;
+        }
+    }
+
+    BinaryTableSource(const QString &path, const QVector<Type> &columns, const qint64 offset,
+                      const int precision): file(path), columns(columns), precision(precision),
+                                            position(offset) {
+        for (const Type type: columns) {
+            recordSize += typeSize(type);
+        }
+        if (!file.open(QIODevice::ReadOnly)) {
+            qWarning() << "Не удалось открыть таблицу" << path << file.errorString();
+            return;
+        }
+        end = file.size();
+    }
+
+    ~BinaryTableSource() override {
+        if (window) file.unmap(window);
+    }
+
+    bool next(QVector<QByteArray> &cells) override {
+        cells.clear();
+        if (recordSize <= 0 || position + recordSize > end) return false;
+        if (!window || position + recordSize > windowBegin + windowSize) {
+            if (window) file.unmap(window);
+            // Окно из целого числа записей
+            windowBegin = position;
+            windowSize = qMin(end - position, qMax<qint64>(1, windowBytes / recordSize) *
+                                              recordSize);
+            window = file.map(windowBegin, windowSize);
+            if (!window) return false;
+        }
+        const uchar *p = window + (position - windowBegin);
+        for (const Type type: columns) {
+            switch (type) {
+                case Int16: {
+                    qint16 v;
+                    memcpy(&v, p, sizeof v);
+                    cells.append(QByteArray::number(v));
+                    break;
+                }
+                case Int32: {
+                    qint32 v;
+                    memcpy(&v, p, sizeof v);
+                    cells.append(QByteArray::number(v));
+                    break;
+                }
+                case Float32: {
+                    float v;
+                    memcpy(&v, p, sizeof v);
+                    cells.append(QByteArray::number(v, 'f', precision));
+                    break;
+                }
+                case Float64: {
+                    double v;
+                    memcpy(&v, p, sizeof v);
+                    cells.append(QByteArray::number(v, 'f', precision));
+                    break;
+                }
+            }
+            p += typeSize(type);
+        }
+        position += recordSize;
+        return true;
+    }
+};
+
+inline void Pdf::splitTableRow(const QVector<qreal> &borders,
+                               const QVector<QByteArray> &contents,
+                               const QVector<int> &formats, const bool drawGrid) {
+    TableLayout table(*this, borders, formats);
+    table.grid = drawGrid;
+    table.addRow(contents);
+    table.finish();
+}
+
+// Статистика записи за один проход: среднее, СКЗ, размах, пик и пик-фактор.
+// Ядра по типу отсчетов: AVX2 (выбирается во время работы), SSE2 (есть у любого
+// x86-64) и скалярное для остальных процессоров. Суммы float копятся в векторах
+// блоками по floatBlockSize отсчетов (не больше 512 сложений на элемент вектора) и
+// переносятся в double, суммы int16 - целые блоками по blockSize
+struct SignalStats final {
+    qint64 count = 0;
+    double mean = 0;
+    double rms = 0;
+    double min = 0;
+    double max = 0;
+
+    double peak() const {
+        return qMax(qAbs(min), qAbs(max));
+    }
+
+    double peakToPeak() const {
+        return max - min;
+    }
+
+    double crest() const {
+        return rms > 0 ? peak() / rms : 0;
+    }
+
+    // Накопленные суммы; из них получается статистика (finish)
+    struct Sums {
+        double sum = 0;
+        double squares = 0;
+        float min = std::numeric_limits<float>::max();
+        float max = std::numeric_limits<float>::lowest();
+    };
+
+    static constexpr int blockSize = 1 << 16;
+    // Ошибка округления суммы float растет с числом сложений в элементе вектора
+    static constexpr int floatBlockSize = 1 << 12;
+
+    static void scalar(const float *data, const qint64 n, Sums &s) {
+        for (qint64 i = 0; i < n; ++i) {
+            const float v = data[i];
+            s.sum += v;
+            s.squares += static_cast<double>(v) * v;
+            s.min = qMin(s.min, v);
+            s.max = qMax(s.max, v);
+        }
+    }
+
+    static void scalar(const qint16 *data, const qint64 n, Sums &s) {
+        qint64 sum = 0;
+        quint64 squares = 0;
+        for (qint64 i = 0; i < n; ++i) {
+            const int v = data[i];
+            sum += v;
+            squares += static_cast<quint64>(v * v);
+            s.min = qMin(s.min, static_cast<float>(v));
+            s.max = qMax(s.max, static_cast<float>(v));
+        }
+        s.sum += sum;
+        s.squares += squares;
+    }
+
+#if defined(Q_PROCESSOR_X86) && (defined(Q_PROCESSOR_X86_64) || defined(__SSE2__))
+    static float horizontalMin(const __m128 v) {
+        __m128 m = _mm_min_ps(v, _mm_movehl_ps(v, v));
+        m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+        return _mm_cvtss_f32(m);
+    }
+
+    static float horizontalMax(const __m128 v) {
+        __m128 m = _mm_max_ps(v, _mm_movehl_ps(v, v));
+        m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+        return _mm_cvtss_f32(m);
+    }
+
+    static double horizontalSum(const __m128 v) {
+        float lanes[4];
+        _mm_storeu_ps(lanes, v);
+        return static_cast<double>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    static void sse2(const float *data, const qint64 n, Sums &s) {
+        qint64 i = 0;
+        __m128 lo = _mm_set1_ps(s.min);
+        __m128 hi = _mm_set1_ps(s.max);
+        while (n - i >= 8) {
+            const qint64 end = i + qMin<qint64>(floatBlockSize, (n - i) & ~qint64(7));
+            __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+            __m128 sq0 = _mm_setzero_ps(), sq1 = _mm_setzero_ps();
+            for (; i < end; i += 8) {
+                const __m128 a = _mm_loadu_ps(data + i);
+                const __m128 b = _mm_loadu_ps(data + i + 4);
+                sum0 = _mm_add_ps(sum0, a);
+                sum1 = _mm_add_ps(sum1, b);
+                sq0 = _mm_add_ps(sq0, _mm_mul_ps(a, a));
+                sq1 = _mm_add_ps(sq1, _mm_mul_ps(b, b));
+                lo = _mm_min_ps(lo, _mm_min_ps(a, b));
+                hi = _mm_max_ps(hi, _mm_max_ps(a, b));
+            }
+            s.sum += horizontalSum(_mm_add_ps(sum0, sum1));
+            s.squares += horizontalSum(_mm_add_ps(sq0, sq1));
+        }
+        s.min = horizontalMin(lo);
+        s.max = horizontalMax(hi);
+        scalar(data + i, n - i, s);
+    }
+
+    static void sse2(const qint16 *data, const qint64 n, Sums &s) {
+        qint64 i = 0;
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128i zero = _mm_setzero_si128();
+        __m128i lo = _mm_set1_epi16(32767);
+        __m128i hi = _mm_set1_epi16(-32768);
+        __m128i squares = _mm_setzero_si128(); // 2 x uint64
+        qint64 sum = 0;
+        while (n - i >= 8) {
+            // int32-суммы пар не переполнятся за blockSize / 8 итераций
+            const qint64 end = i + qMin<qint64>(blockSize, (n - i) & ~qint64(7));
+            __m128i blockSum = _mm_setzero_si128();
+            for (; i < end; i += 8) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+                blockSum = _mm_add_epi32(blockSum, _mm_madd_epi16(v, ones));
+                // Сумма квадратов пары до 2^31 - как беззнаковое 32-битное
+                const __m128i sq = _mm_madd_epi16(v, v);
+                squares = _mm_add_epi64(squares, _mm_unpacklo_epi32(sq, zero));
+                squares = _mm_add_epi64(squares, _mm_unpackhi_epi32(sq, zero));
+                lo = _mm_min_epi16(lo, v);
+                hi = _mm_max_epi16(hi, v);
+            }
+            qint32 lanes[4];
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), blockSum);
+            sum += static_cast<qint64>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+        }
+        quint64 sq[2];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(sq), squares);
+        qint16 los[8];
+        qint16 his[8];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(los), lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(his), hi);
+        if (i > 0) {
+            s.sum += sum;
+            s.squares += static_cast<double>(sq[0]) + static_cast<double>(sq[1]);
+            s.min = qMin<float>(s.min, *std::min_element(los, los + 8));
+            s.max = qMax<float>(s.max, *std::max_element(his, his + 8));
+        }
+        scalar(data + i, n - i, s);
+    }
+
+#ifdef Q_CC_GNU
+    __attribute__((target("avx2"))) static void avx2(const float *data, const qint64 n, Sums &s) {
+        qint64 i = 0;
+        __m256 lo = _mm256_set1_ps(s.min);
+        __m256 hi = _mm256_set1_ps(s.max);
+        while (n - i >= 16) {
+            const qint64 end = i + qMin<qint64>(floatBlockSize, (n - i) & ~qint64(15));
+            __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+            __m256 sq0 = _mm256_setzero_ps(), sq1 = _mm256_setzero_ps();
+            for (; i < end; i += 16) {
+                const __m256 a = _mm256_loadu_ps(data + i);
+                const __m256 b = _mm256_loadu_ps(data + i + 8);
+                sum0 = _mm256_add_ps(sum0, a);
+                sum1 = _mm256_add_ps(sum1, b);
+                sq0 = _mm256_add_ps(sq0, _mm256_mul_ps(a, a));
+                sq1 = _mm256_add_ps(sq1, _mm256_mul_ps(b, b));
+                lo = _mm256_min_ps(lo, _mm256_min_ps(a, b));
+                hi = _mm256_max_ps(hi, _mm256_max_ps(a, b));
+            }
+            const __m256 sum = _mm256_add_ps(sum0, sum1);
+            const __m256 sq = _mm256_add_ps(sq0, sq1);
+            s.sum += horizontalSum(_mm_add_ps(_mm256_castps256_ps128(sum),
+                                              _mm256_extractf128_ps(sum, 1)));
+            s.squares += horizontalSum(_mm_add_ps(_mm256_castps256_ps128(sq),
+                                                  _mm256_extractf128_ps(sq, 1)));
+        }
+        s.min = horizontalMin(_mm_min_ps(_mm256_castps256_ps128(lo),
+                                         _mm256_extractf128_ps(lo, 1)));
+        s.max = horizontalMax(_mm_max_ps(_mm256_castps256_ps128(hi),
+                                         _mm256_extractf128_ps(hi, 1)));
+        sse2(data + i, n - i, s);
+    }
+
+    __attribute__((target("avx2"))) static void avx2(const qint16 *data, const qint64 n,
+                                                     Sums &s) {
+        qint64 i = 0;
+        const __m256i ones = _mm256_set1_epi16(1);
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i lo = _mm256_set1_epi16(32767);
+        __m256i hi = _mm256_set1_epi16(-32768);
+        __m256i squares = _mm256_setzero_si256(); // 4 x uint64
+        qint64 sum = 0;
+        while (n - i >= 16) {
+            const qint64 end = i + qMin<qint64>(blockSize, (n - i) & ~qint64(15));
+            __m256i blockSum = _mm256_setzero_si256();
+            for (; i < end; i += 16) {
+                const __m256i v = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(data + i));
+                blockSum = _mm256_add_epi32(blockSum, _mm256_madd_epi16(v, ones));
+                const __m256i sq = _mm256_madd_epi16(v, v);
+                squares = _mm256_add_epi64(squares, _mm256_unpacklo_epi32(sq, zero));
+                squares = _mm256_add_epi64(squares, _mm256_unpackhi_epi32(sq, zero));
+                lo = _mm256_min_epi16(lo, v);
+                hi = _mm256_max_epi16(hi, v);
+            }
+            qint32 lanes[8];
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), blockSum);
+            for (const qint32 lane: lanes) {
+                sum += lane;
+            }
+        }
+        if (i > 0) {
+            quint64 sq[4];
+            qint16 los[16];
+            qint16 his[16];
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(sq), squares);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(los), lo);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(his), hi);
+            s.sum += sum;
+            for (const quint64 lane: sq) {
+                s.squares += static_cast<double>(lane);
+            }
+            s.min = qMin<float>(s.min, *std::min_element(los, los + 16));
+            s.max = qMax<float>(s.max, *std::max_element(his, his + 16));
+        }
+        sse2(data + i, n - i, s);
+    }
+
+    static bool hasAvx2() {
+        static const bool result = __builtin_cpu_supports("avx2");
+        return result;
+    }
+#endif
+
+    template<typename T>
+    static void accumulate(const T *data, const qint64 n, Sums &s) {
+#ifdef Q_CC_GNU
+        if (hasAvx2()) {
+            avx2(data, n, s);
+            return;
+        }
+#endif
+        sse2(data, n, s);
+    }
+#else
+    template<typename T>
+    static void accumulate(const T *data, const qint64 n, Sums &s) {
+        scalar(data, n, s);
+    }
+#endif
+
+    // scale - множитель отсчетов (int16 -> единицы измерения)
+    static SignalStats finish(const Sums &s, const qint64 n, const double scale) {
+        SignalStats result;
+        if (n <= 0) return result;
+        result.count = n;
+        result.mean = s.sum / n * scale;
+        result.rms = std::sqrt(s.squares / n) * qAbs(scale);
+        result.min = s.min * scale;
+        result.max = s.max * scale;
+        if (scale < 0) std::swap(result.min, result.max);
+        return result;
+    }
+
+    static SignalStats compute(const float *data, const qint64 n, const double scale = 1) {
+        Sums s;
+        accumulate(data, n, s);
+        return finish(s, n, scale);
+    }
+
+    static SignalStats compute(const qint16 *data, const qint64 n, const double scale = 1) {
+        Sums s;
+        accumulate(data, n, s);
+        return finish(s, n, scale);
+    }
+};
+
+// Банк фильтров - каскад биквадратных звеньев (транспонированная прямая форма II)
+// по многоканальным кадрам с чередованием каналов. Звенья Баттерворта считаются по
+// формулам RBJ. Кадры обрабатываются блоками, состояние звеньев сохраняется между
+// вызовами process, так что запись любой длины фильтруется потоком. Каналы идут
+// по 4 в регистре SSE; остаток каналов - скалярно
+struct FilterBank final {
+    struct Section {
+        float b0, b1, b2, a1, a2;
+    };
+
+    // Звено настройки: {"type": "lowpass" | "highpass" | "bandpass", "frequency": Гц,
+    //  "low": Гц, "high": Гц (полоса), "order": порядок Баттерворта}
+    struct Stage {
+        enum Kind { LowPass, HighPass, BandPass };
+
+        Kind kind = LowPass;
+        double low = 0;
+        double high = 0;
+        int order = 2;
+
+        QString description() const {
+            const QString suffix = order != 2 ? QString(" (%1-й порядок)").arg(order) : "";
+            switch (kind) {
+                case LowPass: return QString("ФНЧ %1 Гц").arg(high) + suffix;
+                case HighPass: return QString("ФВЧ %1 Гц").arg(low) + suffix;
+                default: return QString("ПФ %1-%2 Гц").arg(low).arg(high) + suffix;
+            }
+        }
+    };
+
+    static constexpr int blockFrames = 4096;
+
+    QVector<Stage> stages;
+    QVector<Section> sections;
+    int channels = 1;
+    QVector<float> state; // [звено][z1 | z2][канал]
+
+    static Section section(const bool highPass, const double frequency, const double rate,
+                           const double q) {
+        const double w0 = 2 * M_PI * qBound(1e-6, frequency / rate, 0.499);
+        const double c = std::cos(w0);
+        const double alpha = std::sin(w0) / (2 * q);
+        const double a0 = 1 + alpha;
+        const double b1 = highPass ? -(1 + c) : 1 - c;
+        const double b0 = qAbs(b1) / 2;
+        return {
+            static_cast<float>(b0 / a0), static_cast<float>(b1 / a0),
+            static_cast<float>(b0 / a0), static_cast<float>(-2 * c / a0),
+            static_cast<float>((1 - alpha) / a0)
+        };
+    }
+
+    // Звено первого порядка (b2 = a2 = 0) - вещественный полюс нечетного порядка
+    static Section firstOrderSection(const bool highPass, const double frequency,
+                                     const double rate) {
+        const double k = std::tan(M_PI * qBound(1e-6, frequency / rate, 0.499));
+        const double b0 = highPass ? 1 / (1 + k) : k / (1 + k);
+        return {
+            static_cast<float>(b0), static_cast<float>(highPass ? -b0 : b0), 0,
+            static_cast<float>((k - 1) / (k + 1)), 0
+        };
+    }
+
+    // Баттерворт порядка order - order / 2 звеньев с добротностями пар полюсов и
+    // звено первого порядка при нечетном order
+    void addButterworth(const bool highPass, const double frequency, const double rate,
+                        const int order) {
+        for (int k = 0; k < order / 2; ++k) {
+            const double q = 1 / (2 * std::sin((2 * k + 1) * M_PI / (2 * order)));
+            sections.append(section(highPass, frequency, rate, q));
+        }
+        if (order % 2) {
+            sections.append(firstOrderSection(highPass, frequency, rate));
+        }
+    }
+
+    static FilterBank fromJson(const QJsonArray &config, const double rate, const int channels) {
+        FilterBank bank;
+        bank.channels = qMax(1, channels);
+        static const QHash<QString, Stage::Kind> kinds = {
+            {"lowpass", Stage::LowPass}, {"highpass", Stage::HighPass},
+            {"bandpass", Stage::BandPass}
+        };
+        for (const auto &value: config) {
+            const QJsonObject o = value.toObject();
+            Stage stage;
+            stage.kind = kinds.value(o.value("type").toString(), Stage::LowPass);
+            const double frequency = o.value("frequency").toDouble();
+            stage.low = o.value("low").toDouble(frequency);
+            stage.high = o.value("high").toDouble(frequency);
+            stage.order = qMax(1, o.value("order").toInt(2));
+            if (stage.kind != Stage::LowPass) {
+                bank.addButterworth(true, stage.low, rate, stage.order);
+            }
+            if (stage.kind != Stage::HighPass) {
+                bank.addButterworth(false, stage.high, rate, stage.order);
+            }
+            bank.stages.append(stage);
+        }
+        bank.state.fill(0, bank.sections.size() * 2 * bank.channels);
+        return bank;
+    }
+
+    QString description() const {
+        QStringList result;
+        for (const Stage &stage: stages) {
+            result.append(stage.description());
+        }
+        return result.isEmpty() ? "нет" : result.join(", ");
+    }
+
+    // frames кадров по channels отсчетов, на месте
+    void process(float *data, const qint64 frames) {
+        for (qint64 begin = 0; begin < frames; begin += blockFrames) {
+            const qint64 count = qMin<qint64>(blockFrames, frames - begin);
+            for (int s = 0; s < sections.size(); ++s) {
+                processSection(sections[s], state.data() + s * 2 * channels,
+                               data + begin * channels, count);
+            }
+        }
+    }
+
+    void processSection(const Section &k, float *z, float *data, const qint64 frames) const {
+        float *z1 = z;
+        float *z2 = z + channels;
+        int c = 0;
+#if defined(Q_PROCESSOR_X86) && (defined(Q_PROCESSOR_X86_64) || defined(__SSE2__))
+        const __m128 b0 = _mm_set1_ps(k.b0), b1 = _mm_set1_ps(k.b1), b2 = _mm_set1_ps(k.b2);
+        const __m128 a1 = _mm_set1_ps(k.a1), a2 = _mm_set1_ps(k.a2);
+        for (; c + 4 <= channels; c += 4) {
+            __m128 s1 = _mm_loadu_ps(z1 + c);
+            __m128 s2 = _mm_loadu_ps(z2 + c);
+            float *p = data + c;
+            for (qint64 f = 0; f < frames; ++f, p += channels) {
+                const __m128 x = _mm_loadu_ps(p);
+                const __m128 y = _mm_add_ps(_mm_mul_ps(b0, x), s1);
+                s1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), s2);
+                s2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+                _mm_storeu_ps(p, y);
+            }
+            _mm_storeu_ps(z1 + c, s1);
+            _mm_storeu_ps(z2 + c, s2);
+        }
+#endif
+        for (; c < channels; ++c) {
+            float s1 = z1[c];
+            float s2 = z2[c];
+            float *p = data + c;
+            for (qint64 f = 0; f < frames; ++f, p += channels) {
+                const float x = *p;
+                const float y = k.b0 * x + s1;
+                s1 = k.b1 * x - k.a1 * y + s2;
+                s2 = k.b2 * x - k.a2 * y;
+                *p = y;
+            }
+            z1[c] = s1;
+            z2[c] = s2;
+        }
+    }
+};
+
+// Действительное БПФ размера size (степень двойки) через комплексное БПФ половинного
+// размера: поворачивающие множители, перестановка и окно Ханна считаются один раз
+// на размер. Спектр записи - среднее по перекрывающимся на половину сегментам
+// (метод Уэлча), сегменты делятся между потоками пула
+struct Fft final {
+    typedef std::complex<float> Complex;
+
+    int size = 0;
+    QVector<int> reversal; // перестановка для size / 2
+    QVector<Complex> twiddles; // exp(-2 pi i k / (size / 2)), k < size / 4
+    QVector<Complex> split; // exp(-2 pi i k / size), k < size / 2
+    QVector<float> window;
+    double windowSum = 0;
+
+    static QSharedPointer<const Fft> plan(const int size) {
+        static QMutex cacheMutex;
+        static QHash<int, QSharedPointer<const Fft> > cache;
+        QMutexLocker locker(&cacheMutex);
+        const auto it = cache.constFind(size);
+        if (it != cache.constEnd()) {
+            return *it;
+        }
+        auto result = QSharedPointer<Fft>::create();
+        result->size = size;
+        const int half = size / 2;
+        int bits = 0;
+        while ((1 << bits) < half) ++bits;
+        result->reversal.resize(half);
+        for (int i = 0; i < half; ++i) {
+            int r = 0;
+            for (int b = 0; b < bits; ++b) {
+                r |= ((i >> b) & 1) << (bits - 1 - b);
+            }
+            result->reversal[i] = r;
+        }
+        for (int k = 0; k < half / 2; ++k) {
+            result->twiddles.append(std::polar(1.0f, static_cast<float>(-2 * M_PI * k / half)));
+        }
+        for (int k = 0; k < half; ++k) {
+            result->split.append(std::polar(1.0f, static_cast<float>(-2 * M_PI * k / size)));
+        }
+        result->window.resize(size);
+        for (int i = 0; i < size; ++i) {
+            result->window[i] = static_cast<float>(0.5 - 0.5 * std::cos(2 * M_PI * i / size));
+            result->windowSum += result->window[i];
+        }
+        cache.insert(size, result);
+        return result;
+    }
+
+    // Комплексное БПФ по основанию 2 на месте, n = size / 2
+    void transform(Complex *a) const {
+        const int n = size / 2;
+        for (int i = 0; i < n; ++i) {
+            if (i < reversal[i]) std::swap(a[i], a[reversal[i]]);
+        }
+        for (int len = 2; len <= n; len <<= 1) {
+            const int step = n / len;
+            const int halfLen = len / 2;
+            for (int i = 0; i < n; i += len) {
+                for (int j = 0; j < halfLen; ++j) {
+                    const Complex u = a[i + j];
+                    const Complex v = a[i + j + halfLen] * twiddles[j * step];
+                    a[i + j] = u + v;
+                    a[i + j + halfLen] = u - v;
+                }
+            }
+        }
+    }
+
+    // Прибавляет |X[k]|^2 сегмента x (size отсчетов, с окном) к power (size / 2 + 1)
+    void accumulate(const float *x, Complex *work, double *power) const {
+        const int n = size / 2;
+        for (int i = 0; i < n; ++i) {
+            work[i] = Complex(x[2 * i] * window[2 * i], x[2 * i + 1] * window[2 * i + 1]);
+        }
+        transform(work);
+        power[0] += std::norm(work[0].real() + work[0].imag());
+        power[n] += std::norm(work[0].real() - work[0].imag());
+        for (int k = 1; k < n; ++k) {
+            const Complex z = work[k];
+            const Complex zc = std::conj(work[n - k]);
+            const Complex even = (z + zc) * 0.5f;
+            const Complex odd = (z - zc) * Complex(0, -0.5f);
+            power[k] += std::norm(even + split[k] * odd);
+        }
+    }
+
+    // Амплитудный спектр (пиковые значения, те же единицы, что у x) по сегментам
+    // со сдвигом size / 2; count >= size
+    QVector<float> amplitude(const float *x, const qint64 count) const {
+        const int bins = size / 2 + 1;
+        const qint64 hop = size / 2;
+        const qint64 segments = (count - size) / hop + 1;
+        const int threads = static_cast<int>(qBound<qint64>(1, QThread::idealThreadCount(),
+                                                            segments));
+        QVector<QFuture<QVector<double> > > futures;
+        for (int t = 0; t < threads; ++t) {
+            const qint64 first = segments * t / threads;
+            const qint64 last = segments * (t + 1) / threads;
+            futures.append(QtConcurrent::run([this, x, first, last, hop, bins] {
+                QVector<double> power(bins, 0.0);
+                QVector<Complex> work(size / 2);
+                for (qint64 s = first; s < last; ++s) {
+                    accumulate(x + s * hop, work.data(), power.data());
+                }
+                return power;
+            }));
+        }
+        QVector<double> power(bins, 0.0);
+        for (auto &future: futures) {
+            const QVector<double> part = future.result();
+            for (int k = 0; k < bins; ++k) {
+                power[k] += part[k];
+            }
+        }
+        QVector<float> result(bins);
+        for (int k = 0; k < bins; ++k) {
+            const double factor = k == 0 || k == bins - 1 ? 1 : 2;
+            result[k] = static_cast<float>(factor * std::sqrt(power[k] / segments) / windowSum);
+        }
+        return result;
+    }
+};
+
+// Запись сигнала: отсчеты int16 или float32 (порядок байт машины) из файла,
+// отображенного в память, либо готовый массив float (результат обработки).
+// При загрузке один раз строится пирамида минимумов/максимумов, поэтому график
+// по ней стоит O(ширины графика), а не O(числа отсчетов)
+struct Signal final {
+    enum Type { Int16, Float32 };
+
+    // Уровень пирамиды: min/max по блокам из block отсчетов
+    struct Level {
+        qint64 block;
+        QVector<float> min;
+        QVector<float> max;
+    };
+
+    static constexpr int firstBlock = 16;
+    static constexpr int levelFactor = 4;
+    // Предел отсчетов в памяти (1 ГиБ float): QVector индексируется int, а размер
+    // его данных в байтах тоже должен помещаться в int
+    static constexpr qint64 maxSamples = qint64(1) << 28;
+
+    QSharedPointer<QFile> file; // владелец отображения
+    const uchar *data = nullptr;
+    Type type = Float32;
+    qint64 count = 0;
+    double rate = 1; // Гц
+    float scale = 1; // int16 -> единицы измерения
+    QString units;
+    QString processing = "нет"; // примененные фильтры (FilterBank::description)
+    QString axisUnits = "с"; // ось X графика: duration() в этих единицах
+    QVector<float> samples; // если не пусто, data указывает сюда
+    QVector<Level> levels;
+    SignalStats stats;
+    QByteArray key; // для ключа снимка отчета
+    // Спектры по размеру БПФ, считаются при первом обращении
+    mutable QMutex spectrumMutex;
+    mutable QHash<int, QSharedPointer<const Signal> > spectra;
+
+    float at(const qint64 i) const {
+        if (type == Int16) {
+            qint16 v;
+            memcpy(&v, data + i * 2, sizeof v);
+            return v * scale;
+        }
+        float v;
+        memcpy(&v, data + i * 4, sizeof v);
+        return v;
+    }
+
+    // Минимум и максимум отсчетов [begin, end) прямым просмотром
+    void scan(const qint64 begin, const qint64 end, float &lo, float &hi) const {
+        lo = std::numeric_limits<float>::max();
+        hi = std::numeric_limits<float>::lowest();
+        for (qint64 i = begin; i < end; ++i) {
+            const float v = at(i);
+            lo = qMin(lo, v);
+            hi = qMax(hi, v);
+        }
+    }
+
+    void buildLevels() {
+        levels.clear();
+        if (count < 2 * firstBlock) return;
+        // У очень длинной отображенной записи первый уровень грубее
+        qint64 block = firstBlock;
+        while ((count + block - 1) / block > maxSamples) block *= levelFactor;
+        Level first{block, {}, {}};
+        const int blocks = static_cast<int>((count + block - 1) / block);
+        first.min.resize(blocks);
+        first.max.resize(blocks);
+        for (int b = 0; b < blocks; ++b) {
+            const qint64 begin = b * block;
+            scan(begin, qMin(count, begin + block), first.min[b], first.max[b]);
+        }
+        levels.append(first);
+        while (levels.last().min.size() >= 2 * levelFactor) {
+            const Level &fine = levels.last();
+            Level coarse{fine.block * levelFactor, {}, {}};
+            const int size = (fine.min.size() + levelFactor - 1) / levelFactor;
+            coarse.min.resize(size);
+            coarse.max.resize(size);
+            for (int b = 0; b < size; ++b) {
+                const int from = b * levelFactor;
+                const int to = qMin(fine.min.size(), from + levelFactor);
+                coarse.min[b] = *std::min_element(fine.min.begin() + from, fine.min.begin() + to);
+                coarse.max[b] = *std::max_element(fine.max.begin() + from, fine.max.begin() + to);
+            }
+            levels.append(coarse);
+        }
+    }
+
+    // Минимум и максимум на [begin, end). Берется самый грубый уровень, блок которого
+    // не больше четверти интервала; границы округляются до блоков этого уровня -
+    // ошибка меньше четверти столбца графика
+    void range(const qint64 begin, const qint64 end, float &lo, float &hi) const {
+        const Level *level = nullptr;
+        for (const Level &l: levels) {
+            if (l.block * 4 > end - begin) break;
+            level = &l;
+        }
+        if (!level) {
+            scan(begin, end, lo, hi);
+            return;
+        }
+        const int from = static_cast<int>(begin / level->block);
+        const int to = qMax(from + 1, static_cast<int>(end / level->block));
+        lo = *std::min_element(level->min.begin() + from, level->min.begin() + to);
+        hi = *std::max_element(level->max.begin() + from, level->max.begin() + to);
+    }
+
+    double duration() const {
+        return count / rate;
+    }
+
+    // Потоковая обработка кадров из channels каналов: блок переводится во float,
+    // проходит банк фильтров, и остаются отсчеты канала channel. После этого
+    // отображение файла не нужно. Результат целиком в памяти, поэтому запись длиннее
+    // maxSamples кадров не обрабатывается (false)
+    bool process(FilterBank &bank, const int channel) {
+        if (count > maxSamples) return false;
+        const int channels = bank.channels;
+        QVector<float> output(static_cast<int>(count));
+        QVector<float> block(FilterBank::blockFrames * channels);
+        for (qint64 begin = 0; begin < count; begin += FilterBank::blockFrames) {
+            const int frames = static_cast<int>(qMin<qint64>(FilterBank::blockFrames,
+                                                             count - begin));
+            for (int i = 0; i < frames * channels; ++i) {
+                block[i] = at(begin * channels + i);
+            }
+            bank.process(block.data(), frames);
+            for (int f = 0; f < frames; ++f) {
+                output[static_cast<int>(begin) + f] = block[f * channels + channel];
+            }
+        }
+        samples = output;
+        data = reinterpret_cast<const uchar *>(samples.constData());
+        type = Float32;
+        scale = 1;
+        file.reset();
+        processing = bank.description();
+        return true;
+    }
+
+    // Пирамида и статистика - при загрузке, один раз на запись
+    void prepare() {
+        buildLevels();
+        stats = type == Int16
+                    ? SignalStats::compute(reinterpret_cast<const qint16 *>(data), count, scale)
+                    : SignalStats::compute(reinterpret_cast<const float *>(data), count);
+    }
+
+    // Амплитудный спектр как сигнал по оси частот (Гц); size - размер БПФ,
+    // уменьшается до длины записи
+    QSharedPointer<const Signal> spectrum(int size) const {
+        if (size <= 0 || (size & (size - 1)) != 0) size = 8192;
+        while (size > 16 && size > count) size /= 2;
+        if (size < 16 || count < size) return {};
+        QMutexLocker locker(&spectrumMutex);
+        const auto it = spectra.constFind(size);
+        if (it != spectra.constEnd()) {
+            return *it;
+        }
+        // Спектру нужны отсчеты float подряд; у очень длинной записи int16
+        // усредняются первые maxSamples отсчетов
+        QVector<float> converted;
+        const float *x = reinterpret_cast<const float *>(data);
+        qint64 length = count;
+        if (type != Float32) {
+            length = qMin(count, qint64(maxSamples));
+            converted.resize(static_cast<int>(length));
+            for (int i = 0; i < converted.size(); ++i) {
+                converted[i] = at(i);
+            }
+            x = converted.constData();
+        }
+        const QVector<float> amplitude = Fft::plan(size)->amplitude(x, length);
+        auto result = QSharedPointer<Signal>::create();
+        result->samples = amplitude;
+        result->data = reinterpret_cast<const uchar *>(result->samples.constData());
+        result->count = amplitude.size();
+        result->rate = size / rate; // отсчетов на Гц
+        result->units = units;
+        result->axisUnits = "Гц";
+        result->key = key + "|spectrum" + QByteArray::number(size);
+        result->prepare();
+        spectra.insert(size, result);
+        return result;
+    }
+
+    static QSharedPointer<const Signal> fromSamples(const QVector<float> &samples,
+                                                    const double rate, const QString &units,
+                                                    const QByteArray &key) {
+        auto result = QSharedPointer<Signal>::create();
+        result->samples = samples;
+        result->data = reinterpret_cast<const uchar *>(result->samples.constData());
+        result->count = samples.size();
+        result->rate = rate;
+        result->units = units;
+        result->key = key;
+        result->prepare();
+        return result;
+    }
+
+    // {"path": "файл", "type": "int16" | "float32", "rate": Гц, "scale": множитель int16,
+    //  "offset": байт до первого отсчета, "units": "мм/с", "channels": число каналов
+    //  с чередованием, "channel": канал отчета, "filters": [звенья FilterBank::Stage]}.
+    // Сигналы кэшируются по описанию, несколько последних
+    static QSharedPointer<const Signal> load(const QJsonObject &spec) {
+        static QMutex cacheMutex;
+        static QHash<QByteArray, QSharedPointer<const Signal> > cache;
+        static constexpr int maxSignals = 4;
+        const QString path = spec.value("path").toString();
+        if (path.isEmpty()) return {};
+        const QFileInfo info(path);
+        const QByteArray key = QJsonDocument(spec).toJson(QJsonDocument::Compact) + '|' +
+                               QByteArray::number(info.size()) + '|' +
+                               QByteArray::number(info.lastModified().toMSecsSinceEpoch());
+        QMutexLocker locker(&cacheMutex);
+        const auto it = cache.constFind(key);
+        if (it != cache.constEnd()) {
+            return *it;
+        }
+        auto result = QSharedPointer<Signal>::create();
+        result->file = QSharedPointer<QFile>::create(path);
+        if (!result->file->open(QIODevice::ReadOnly)) {
+            qWarning() << "Не удалось открыть сигнал" << path << result->file->errorString();
+            return {};
+        }
+        result->type = spec.value("type").toString() == "int16" ? Int16 : Float32;
+        result->rate = spec.value("rate").toDouble(25600);
+        result->scale = static_cast<float>(spec.value("scale").toDouble(1));
+        result->units = spec.value("units").toString();
+        result->key = key;
+        const qint64 offset = static_cast<qint64>(spec.value("offset").toDouble(0));
+        const qint64 size = result->file->size() - offset;
+        const int sampleSize = result->type == Int16 ? 2 : 4;
+        const int channels = qMax(1, spec.value("channels").toInt(1));
+        const int channel = qBound(0, spec.value("channel").toInt(0), channels - 1);
+        result->count = size > 0 ? size / sampleSize / channels : 0;
+        if (result->count > 0) {
+            result->data = result->file->map(offset, result->count * channels * sampleSize);
+            if (!result->data) {
+                qWarning() << "Не удалось отобразить сигнал" << path;
+                return {};
+            }
+        }
+        const QJsonArray filters = spec.value("filters").toArray();
+        if (channels > 1 || !filters.isEmpty()) {
+            FilterBank bank = FilterBank::fromJson(filters, result->rate, channels);
+            if (!result->process(bank, channel)) {
+                qWarning() << "Сигнал слишком длинный для обработки" << path << result->count
+                           << "кадров, предел" << maxSamples;
+                return {};
+            }
+        }
+        result->prepare();
+        if (cache.size() >= maxSignals) {
+            cache.clear();
+        }
+        cache.insert(key, result);
+        return result;
+    }
+};
+
+// График сигнала векторными путями прямо в QPainter документа. Каждому столбцу
+// устройства соответствует вертикальный отрезок min..max отсчетов этого столбца, так
+// что в пути не больше двух точек на пиксель ширины при любой длине записи
+struct Plot final {
+    static constexpr int gridX = 10;
+    static constexpr int gridY = 8;
+
+    static QString label(const double value) {
+        return QString::number(value, 'g', 4);
+    }
+
+    static void draw(QPainter &painter, const QRectF &rect, const Signal *signal) {
+        painter.save();
+        QFont font = painter.font();
+        font.setPointSize(10);
+        painter.setFont(font);
+        const QFontMetricsF metrics(font, painter.device());
+        const qreal labelWidth = metrics.horizontalAdvance("-0.0000e+00") + 20;
+        const qreal labelHeight = metrics.height() * 1.5;
+        const QRectF area = rect.adjusted(labelWidth, metrics.height() / 2, 0, -labelHeight);
+
+        if (!signal || signal->count == 0) {
+            painter.setPen(QPen(Qt::black, 2));
+            painter.drawRect(area);
+            painter.drawText(area, Qt::AlignCenter, "Нет данных");
+            painter.restore();
+            return;
+        }
+
+        float lo;
+        float hi;
+        signal->range(0, signal->count, lo, hi);
+        if (hi <= lo) {
+            lo -= 1;
+            hi += 1;
+        }
+        const qreal pad = (hi - lo) * 0.05;
+        const qreal yMin = lo - pad;
+        const qreal yMax = hi + pad;
+        const auto toY = [&area, yMin, yMax](const qreal v) {
+            return area.bottom() - (v - yMin) / (yMax - yMin) * area.height();
+        };
+
+        // Сетка и подписи
+        painter.setPen(QPen(Qt::lightGray, 1, Qt::DotLine));
+        for (int i = 1; i < gridX; ++i) {
+            const qreal x = area.left() + area.width() * i / gridX;
+            painter.drawLine(QPointF(x, area.top()), QPointF(x, area.bottom()));
+        }
+        for (int i = 1; i < gridY; ++i) {
+            const qreal y = area.top() + area.height() * i / gridY;
+            painter.drawLine(QPointF(area.left(), y), QPointF(area.right(), y));
+        }
+        painter.setPen(Qt::black);
+        for (int i = 0; i <= gridY; ++i) {
+            const qreal y = area.bottom() - area.height() * i / gridY;
+            painter.drawText(QRectF(rect.left(), y - labelHeight / 2, labelWidth - 10,
+                                    labelHeight),
+                             Qt::AlignRight | Qt::AlignVCenter,
+                             label(yMin + (yMax - yMin) * i / gridY));
+        }
+        for (int i = 0; i <= gridX; i += 2) {
+            const qreal x = area.left() + area.width() * i / gridX;
+            painter.drawText(QRectF(x - labelWidth / 2, area.bottom(), labelWidth, labelHeight),
+                             Qt::AlignHCenter | Qt::AlignBottom,
+                             label(signal->duration() * i / gridX) +
+                             (i == gridX ? " " + signal->axisUnits : ""));
+        }
+        if (!signal->units.isEmpty()) {
+            painter.drawText(QRectF(rect.left(), rect.top(), labelWidth - 10, labelHeight),
+                             Qt::AlignRight | Qt::AlignTop, signal->units);
+        }
+
+        // Кривая
+        QPainterPath path;
+        const int columns = qMax(1, qRound(area.width()));
+        if (signal->count <= 2 * columns) {
+            const qreal step = area.width() / qMax<qint64>(1, signal->count - 1);
+            path.moveTo(area.left(), toY(signal->at(0)));
+            for (qint64 i = 1; i < signal->count; ++i) {
+                path.lineTo(area.left() + i * step, toY(signal->at(i)));
+            }
+        } else {
+            const qreal step = area.width() / columns;
+            for (int c = 0; c < columns; ++c) {
+                const qint64 begin = signal->count * c / columns;
+                const qint64 end = signal->count * (c + 1) / columns;
+                float cLo;
+                float cHi;
+                signal->range(begin, end, cLo, cHi);
+                const qreal x = area.left() + (c + 0.5) * step;
+                if (c == 0) {
+                    path.moveTo(x, toY(cHi));
+                } else {
+                    path.lineTo(x, toY(cHi));
+                }
+                path.lineTo(x, toY(cLo));
+            }
+        }
+        painter.setClipRect(area);
+        painter.setPen(QPen(Qt::darkBlue, 2, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin));
+        painter.setBrush(Qt::NoBrush);
+        painter.drawPath(path);
+        painter.setClipping(false);
+        painter.setPen(QPen(Qt::black, 2));
+        painter.drawRect(area);
+        painter.restore();
+    }
+};
+
+// Шаблон отчета (res/report.json): строки таблицы, отступы, рисунок и текст
+// с подстановками {name}. Разбирается один раз, а для каждой ширины страницы
+// строится неизменяемый план: границы переведены в пиксели, высоты строк без
+// подстановок измерены заранее
+struct ReportTemplate final {
+    enum Kind { Row, Skip, Figure, Text, Waveform, Spectrum };
+
+    struct Element {
+        Kind kind = Row;
+        QVector<QPair<qreal, qreal> > borders; // доля ширины и смещение в пикселях
+        QVector<QByteArray> cells;
+        QVector<int> formats;
+        bool bound = false; // есть подстановки - высота измеряется при заполнении
+        qreal maxHeight = -1;
+        qreal height = 0; // Skip, Figure, Waveform, Spectrum: смещение по вертикали
+        int fftSize = 8192; // Spectrum: размер БПФ
+        qreal scaleX = 1;
+        qreal scaleY = 1;
+        bool grid = false;
+        bool keepOnPage = false;
+        bool needsSignal = false; // выводится только при заданном сигнале
+    };
+
+    struct Plan {
+        struct Item {
+            const Element *element;
+            QVector<qreal> borders;
+            qreal height; // < 0 - строка с подстановками
+        };
+
+        QVector<Item> items;
+    };
+
+    QSizeF pageSize; // мм, портретная ориентация
+    QMarginsF margins; // мм, от края бумаги
+    QByteArray paper; // вариант *PageSize в PPD; если задан, размер берется из PPD
+    QString footer; // нижний колонтитул каждой страницы
+    QString watermark;
+    QFont font;
+    QVector<Element> elements;
+    bool usesFigure = false; // нужен снимок окна (ReportJob::figure)
+    // Неизменная часть отчета - элементы до первого, ссылающегося на {note}
+    int noteIndex = 0;
+    mutable QMutex mutex;
+    mutable QHash<int, QSharedPointer<const Plan> > plans; // по ширине страницы
+    // Снимки неизменной части по ключу из ее данных (см. snapshotKey)
+    mutable QHash<QByteArray, QSharedPointer<const Pdf::Snapshot> > snapshots;
+    static constexpr int maxSnapshots = 8;
+
+    static int parseFormat(const QJsonValue &value) {
+        if (value.isDouble()) return value.toInt();
+        using namespace Format;
+        static const QHash<QString, int> names = {
+            {"AlignTop", AlignTop}, {"AlignVCenter", AlignVCenter},
+            {"AlignBottom", AlignBottom}, {"AlignLeft", AlignLeft},
+            {"AlignHCenter", AlignHCenter}, {"AlignRight", AlignRight},
+            {"Italic", Italic}, {"Bold", Bold}, {"Picture", Picture}, {"VUse", VUse},
+            {"Small", Small}
+        };
+        int format = 0;
+        for (const auto &name: value.toArray()) {
+            format |= names.value(name.toString());
+        }
+        return format;
+    }
+
+    // Граница - доля ширины (число) или пара [доля, смещение в пикселях]
+    static QPair<qreal, qreal> parseBorder(const QJsonValue &value) {
+        if (value.isArray()) {
+            const QJsonArray a = value.toArray();
+            return {a.at(0).toDouble(), a.at(1).toDouble()};
+        }
+        return {value.toDouble(), 0};
+    }
+
+    static QSharedPointer<ReportTemplate> fromJson(const QJsonObject &o) {
+        auto result = QSharedPointer<ReportTemplate>::create();
+        const QJsonObject page = o.value("page").toObject();
+        result->pageSize = QSizeF(page.value("width").toDouble(210),
+                                  page.value("height").toDouble(297));
+        const QJsonArray margins = page.value("margins").toArray({20, 20, 10, 20});
+        result->paper = page.value("paper").toString().toLatin1();
+        result->footer = page.value("footer").toString();
+        result->watermark = page.value("watermark").toString();
+        result->margins = QMarginsF(margins.at(0).toDouble(), margins.at(1).toDouble(),
+                                    margins.at(2).toDouble(), margins.at(3).toDouble());
+        const QJsonObject font = o.value("font").toObject();
+        result->font = QFont(font.value("family").toString("Times"),
+                             font.value("size").toInt(14));
+        static const QHash<QString, Kind> kinds = {
+            {"row", Row}, {"skip", Skip}, {"figure", Figure}, {"text", Text},
+            {"waveform", Waveform}, {"spectrum", Spectrum}
+        };
+        for (const auto &value: o.value("elements").toArray()) {
+            const QJsonObject e = value.toObject();
+            Element element;
+            element.kind = kinds.value(e.value("type").toString(), Row);
+            for (const auto &border: e.value("borders").toArray()) {
+                element.borders.append(parseBorder(border));
+            }
+            for (const auto &cell: e.value("cells").toArray()) {
+                element.cells.append(cell.toString().toUtf8());
+                element.bound = element.bound || element.cells.last().contains('{');
+            }
+            for (const auto &format: e.value("formats").toArray()) {
+                element.formats.append(parseFormat(format));
+            }
+            element.maxHeight = e.value("maxHeight").toDouble(-1);
+            element.height = e.value("height").toDouble(0);
+            element.scaleX = e.value("scaleX").toDouble(1);
+            element.scaleY = e.value("scaleY").toDouble(1);
+            element.grid = e.value("grid").toBool(false);
+            element.keepOnPage = e.value("keepOnPage").toBool(false);
+            element.needsSignal = e.value("signal").toBool(false);
+            element.fftSize = e.value("size").toInt(element.fftSize);
+            result->elements.append(element);
+            result->usesFigure = result->usesFigure || element.kind == Figure;
+        }
+        result->noteIndex = result->elements.size();
+        for (int i = 0; i < result->elements.size(); ++i) {
+            const auto &cells = result->elements[i].cells;
+            if (std::any_of(cells.begin(), cells.end(), [](const QByteArray &cell) {
+                return cell.contains("{note}");
+            })) {
+                result->noteIndex = i;
+                break;
+            }
+        }
+        return result;
+    }
+
+    // Разобранные шаблоны кэшируются по пути
+    static QSharedPointer<const ReportTemplate> load(const QString &path) {
+        static QMutex cacheMutex;
+        static QHash<QString, QSharedPointer<const ReportTemplate> > cache;
+        QMutexLocker locker(&cacheMutex);
+        const auto it = cache.constFind(path);
+        if (it != cache.constEnd()) {
+            return *it;
+        }
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            qWarning() << "Не удалось открыть шаблон отчета" << path << file.errorString();
+            return {};
+        }
+        QJsonParseError error{};
+        const QJsonDocument json = QJsonDocument::fromJson(file.readAll(), &error);
+        if (!json.isObject()) {
+            qWarning() << "Ошибка разбора шаблона отчета" << path << error.errorString();
+            return {};
+        }
+        const QSharedPointer<const ReportTemplate> result = fromJson(json.object());
+        cache.insert(path, result);
+        return result;
+    }
+
+    void setupPage(Pdf &doc, const int orientation, const Ppd *ppd) const {
+        doc.footerText = footer;
+        doc.watermarkText = watermark;
+        if (ppd && !paper.isEmpty()) {
+            if (ppd->paper(paper).isValid()) {
+                doc.setPage(*ppd, paper, margins, orientation != 0);
+                return;
+            }
+            qWarning() << "В PPD нет бумаги" << paper;
+        }
+        doc.setPageSize(orientation == 0 ? pageSize : pageSize.transposed());
+        doc.setMargins(margins);
+    }
+
+    // План для ширины страницы doc; строки измеряются шрифтом шаблона
+    QSharedPointer<const Plan> plan(const Pdf &doc) const {
+        const qreal w = doc.width();
+        QMutexLocker locker(&mutex);
+        const auto it = plans.constFind(qRound(w));
+        if (it != plans.constEnd()) {
+            return *it;
+        }
+        auto result = QSharedPointer<Plan>::create();
+        for (const Element &element: elements) {
+            Plan::Item item{&element, {}, -1};
+            for (const auto &border: element.borders) {
+                item.borders.append(border.first * w + border.second);
+            }
+            if (element.kind == Row && !element.bound &&
+                Pdf::isValidRow(item.borders, element.cells, element.formats)) {
+                item.height = doc.tableRowHeight(item.borders, element.cells, element.formats,
+                                                 element.maxHeight);
+            }
+            result->items.append(item);
+        }
+        plans.insert(qRound(w), result);
+        return result;
+    }
+
+    // Подстановки за один проход по шаблону слева направо: вставленные значения
+    // повторно не просматриваются, так что "{rms}" в тексте примечания остается текстом
+    static QByteArray bind(const QByteArray &cell, const QHash<QString, QString> &values) {
+        if (!cell.contains('{')) return cell;
+        const QString text = QString::fromUtf8(cell);
+        QString result;
+        result.reserve(text.size());
+        int pos = 0;
+        while (pos < text.size()) {
+            const int open = text.indexOf(QLatin1Char('{'), pos);
+            if (open < 0) break;
+            const int close = text.indexOf(QLatin1Char('}'), open + 1);
+            if (close < 0) break;
+            const auto it = values.constFind(text.mid(open + 1, close - open - 1));
+            if (it == values.constEnd()) {
+                // Не подстановка - скобка остается, поиск продолжается за ней
+                result += text.midRef(pos, open + 1 - pos);
+                pos = open + 1;
+                continue;
+            }
+            result += text.midRef(pos, open - pos);
+            result += *it;
+            pos = close + 1;
+        }
+        result += text.midRef(pos);
+        return result.toUtf8();
+    }
+
+    static QVector<QByteArray> bind(const QVector<QByteArray> &cells,
+                                    const QHash<QString, QString> &values) {
+        QVector<QByteArray> result;
+        result.reserve(cells.size());
+        for (const auto &cell: cells) {
+            result.append(bind(cell, values));
+        }
+        return result;
+    }
+
+    // Все, от чего зависит неизменная часть: геометрия страницы, подстановки кроме
+    // {note}, рисунок, сигнал и время изменения файлов картинок (как у ImageCache)
+    QByteArray snapshotKey(const Pdf &doc, const QHash<QString, QString> &values,
+                           const QPicture &figure, const Signal *signal) const {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        const QPageLayout pageLayout = doc.writer->pageLayout();
+        const QSizeF size = pageLayout.fullRectPixels(doc.resolution()).size();
+        const QRectF paintRect = pageLayout.paintRectPixels(doc.resolution());
+        hash.addData(QByteArray::number(size.width()) + 'x' + QByteArray::number(size.height()));
+        hash.addData(QByteArray::number(paintRect.left()) + ',' +
+                     QByteArray::number(paintRect.top()) + ',' +
+                     QByteArray::number(paintRect.width()) + 'x' +
+                     QByteArray::number(paintRect.height()));
+        QStringList keys = values.keys();
+        keys.sort();
+        for (const auto &key: keys) {
+            if (key == "note") continue;
+            hash.addData(key.toUtf8() + '=' + values.value(key).toUtf8() + '\0');
+        }
+        hash.addData(figure.data(), static_cast<int>(figure.size()));
+        if (signal) hash.addData(signal->key);
+        for (int i = 0; i < noteIndex && i < elements.size(); ++i) {
+            const Element &e = elements[i];
+            if (e.kind != Row) continue;
+            for (int c = 0; c < e.cells.size(); ++c) {
+                if (!(e.formats.value(c) & Format::Picture)) continue;
+                const QByteArray path = e.bound ? bind(e.cells[c], values) : e.cells[c];
+                const QFileInfo info(QString::fromUtf8(path));
+                hash.addData(path + '@' +
+                             QByteArray::number(info.lastModified().toMSecsSinceEpoch()) + '\0');
+            }
+        }
+        return hash.result();
+    }
+
+    void renderItems(Pdf &doc, const Plan &p, const int from, const int to,
+                     const QHash<QString, QString> &values, const QPicture &figure,
+                     const Signal *signal) const {
+        for (int i = from; i < to; ++i) {
+            const auto &item = p.items[i];
+            const Element &e = *item.element;
+            if (e.needsSignal && !signal) continue;
+            switch (e.kind) {
+                case Row:
+                    if (item.height >= 0) {
+                        doc.drawTableRow(item.borders, e.cells, e.formats, item.height,
+                                         e.grid, e.keepOnPage);
+                    } else {
+                        doc.addTableRow(item.borders, bind(e.cells, values), e.formats,
+                                        e.maxHeight, e.grid, e.keepOnPage);
+                    }
+                    break;
+                case Skip:
+                    doc.skip(e.height);
+                    break;
+                case Figure:
+                    doc.painter.save();
+                    doc.painter.scale(e.scaleX, e.scaleY);
+                    doc.painter.translate(0, doc.posY);
+                    doc.painter.drawPicture(0, 0, figure);
+                    doc.painter.restore();
+                    doc.skip(e.height);
+                    break;
+                case Waveform:
+                    if (doc.posY + e.height > doc.pageHeight) {
+                        doc.newPage();
+                    }
+                    Plot::draw(doc.painter, QRectF(0, doc.posY, doc.width(), e.height), signal);
+                    doc.skip(e.height);
+                    break;
+                case Spectrum: {
+                    if (doc.posY + e.height > doc.pageHeight) {
+                        doc.newPage();
+                    }
+                    const auto spectrum = signal ? signal->spectrum(e.fftSize)
+                                                 : QSharedPointer<const Signal>();
+                    Plot::draw(doc.painter, QRectF(0, doc.posY, doc.width(), e.height),
+                               spectrum.data());
+                    doc.skip(e.height);
+                    break;
+                }
+                case Text:
+                    if (item.borders.size() == 2 && !e.cells.isEmpty() && !e.formats.isEmpty()) {
+                        doc.addText(item.borders[0], item.borders[1], bind(e.cells[0], values),
+                                    e.formats[0]);
+                    }
+                    break;
+            }
+        }
+    }
+
+    // Отчет по шаблону (вместо doc.begin()): статические строки рисуются с готовой
+    // высотой, измеряются только строки с подстановками и текст. Неизменная часть
+    // записывается в снимок, и при следующем отчете с теми же данными
+    // размечается заново только примечание
+    void render(Pdf &doc, const QHash<QString, QString> &values, const QPicture &figure,
+                const Signal *signal = nullptr) const {
+        if (noteIndex == 0 || noteIndex == elements.size()) {
+            doc.begin();
+            doc.setFont(font);
+            const auto p = plan(doc);
+            renderItems(doc, *p, 0, p->items.size(), values, figure, signal);
+            return;
+        }
+        const QByteArray key = snapshotKey(doc, values, figure, signal);
+        QSharedPointer<const Pdf::Snapshot> snapshot;
+        //
+        {
+            QMutexLocker locker(&mutex);
+            snapshot = snapshots.value(key);
+        }
+        if (snapshot) {
+            doc.resume(*snapshot);
+        } else {
+            doc.beginRecording(true, true);
+            doc.setFont(font);
+            renderItems(doc, *plan(doc), 0, noteIndex, values, figure, signal);
+            snapshot = QSharedPointer<Pdf::Snapshot>::create(doc.snapshot());
+            if (!doc.isCancelled()) {
+                QMutexLocker locker(&mutex);
+                if (snapshots.size() >= maxSnapshots) {
+                    snapshots.clear();
+                }
+                snapshots.insert(key, snapshot);
+            }
+            doc.resume(*snapshot);
+        }
+        const auto p = plan(doc);
+        renderItems(doc, *p, noteIndex, p->items.size(), values, figure, signal);
+    }
+};
+
+// Записанные страницы отчета, координаты в пикселях документа (300 dpi)
+struct RecordedReport {
+    QVector<QPicture> pages;
+    QRectF fullRect; // страница целиком
+    QRectF paintRect; // область рисования, начало координат страниц
+    int dpi = 300;
+};
+
+// Входные данные отчета. Собираются в GUI-потоке, а сам отчет строится в любом
+struct ReportJob final {
+    int orientation = 0; // 0 - портретная, 1 - альбомная
+    QString source = "Завод_Установка_Агрегат_Точка Измерения";
+    QString printed = "ДД.ММ.ГГГГ чч:мм:сс";
+    QString rms = placeholder();
+    QString peak = placeholder();
+    QString rotational = placeholder();
+    QString note;
+    QPicture figure; // снимок окна, сделанный в GUI-потоке
+    QString templatePath = ":/report.json";
+    QString ppdPath = ":/printer.ppd";
+    QJsonObject table; // таблица из файла после отчета (см. renderTable)
+    QJsonObject signalSpec; // запись сигнала для графика и значений (см. Signal::load)
+
+    static QString placeholder() {
+        return "______ед. изм.";
+    }
+
+    // Задание пакетного режима:
+    // {"source": "...", "printed": "...", "rms": 1.2, "peak": "...", "rotational": ...,
+    //  "units": "мм/с", "note": "...", "orientation": "portrait" | "landscape",
+    //  "template": "путь к шаблону отчета", "ppd": "путь к PPD принтера",
+    //  "table": {...} - см. renderTable, "signal": {...} - см. Signal::load}
+    // Отсутствующие поля остаются заглушками, время печати - текущее
+    static ReportJob fromJson(const QJsonObject &o) {
+        ReportJob job;
+        job.orientation = o.value("orientation").toString() == "landscape" ? 1 : 0;
+        job.source = o.value("source").toString(job.source);
+        job.printed = o.value("printed").toString(
+            QDateTime::currentDateTime().toString("dd.MM.yyyy hh:mm:ss"));
+        const QString units = o.value("units").toString("ед. изм.");
+        const auto value = [&o, &units](const char *key, const QString &placeholder) {
+            const QJsonValue v = o.value(key);
+            if (v.isDouble()) return QString("%1 %2").arg(v.toDouble()).arg(units);
+            return v.toString(placeholder);
+        };
+        job.rms = value("rms", job.rms);
+        job.peak = value("peak", job.peak);
+        job.rotational = value("rotational", job.rotational);
+        job.note = o.value("note").toString();
+        job.templatePath = o.value("template").toString(job.templatePath);
+        job.ppdPath = o.value("ppd").toString(job.ppdPath);
+        job.table = o.value("table").toObject();
+        job.signalSpec = o.value("signal").toObject();
+        if (!job.signalSpec.isEmpty() && !job.signalSpec.contains("units")) {
+            job.signalSpec.insert("units", units);
+        }
+        return job;
+    }
+
+    // Ключ содержимого: все, что вводит пользователь, кроме ориентации. Снимок окна
+    // в ключ не входит - он лишь производный от этих данных
+    QByteArray contentKey() const {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        for (const QString &value: {templatePath, ppdPath, source, printed, rms, peak,
+                                    rotational, note}) {
+            hash.addData(value.toUtf8());
+            hash.addData("\0", 1);
+        }
+        hash.addData(QJsonDocument(table).toJson(QJsonDocument::Compact));
+        hash.addData(QJsonDocument(signalSpec).toJson(QJsonDocument::Compact));
+        return hash.result();
+    }
+
+    // Значения, рассчитанные по записи сигнала, заменяют заглушки; кроме {rms} и
+    // {peak} доступны {p2p}, {crest}, {mean} и {processing} - примененные фильтры
+    QHash<QString, QString> values(const Signal *signal = nullptr) const {
+        QHash<QString, QString> result{
+            {"source", source}, {"printed", printed}, {"rms", rms}, {"peak", peak},
+            {"rotational", rotational}, {"note", note}
+        };
+        result.insert("processing", signal ? signal->processing : "______");
+        if (!signal || signal->count == 0) return result;
+        const SignalStats &stats = signal->stats;
+        const auto value = [signal](const double v) {
+            return QString("%1 %2").arg(v, 0, 'g', 4).arg(signal->units).trimmed();
+        };
+        if (rms == placeholder()) result.insert("rms", value(stats.rms));
+        if (peak == placeholder()) result.insert("peak", value(stats.peak()));
+        result.insert("p2p", value(stats.peakToPeak()));
+        result.insert("mean", value(stats.mean));
+        result.insert("crest", QString::number(stats.crest(), 'g', 3));
+        return result;
+    }
+
+    void layout(Pdf &doc) const {
+        const auto report = ReportTemplate::load(templatePath);
+        if (!report) return;
+        report->setupPage(doc, orientation, Ppd::load(ppdPath).data());
+        const auto signal = Signal::load(signalSpec);
+        report->render(doc, values(signal.data()), figure, signal.data());
+        if (table.isEmpty()) return;
+        // Таблица любой длины - только для вывода в файл: запись страниц в QPicture
+        // (record, векторная печать) держала бы в памяти все ее страницы
+        if (doc.recordOnly) {
+            qWarning() << "Таблица из файла не выводится при векторной печати,"
+                          " используйте PDF или PostScript";
+            return;
+        }
+        renderTable(doc, table);
+    }
+
+    static std::unique_ptr<TableSource> tableSource(const QJsonObject &spec) {
+        if (spec.contains("csv")) {
+            const QByteArray separator = spec.value("separator").toString(",").toLatin1();
+            return std::unique_ptr<TableSource>(new CsvTableSource(
+                spec.value("csv").toString(), separator.isEmpty() ? ',' : separator.at(0)));
+        }
+        static const QHash<QString, BinaryTableSource::Type> types = {
+            {"int16", BinaryTableSource::Int16}, {"int32", BinaryTableSource::Int32},
+            {"float32", BinaryTableSource::Float32}, {"float64", BinaryTableSource::Float64}
+        };
+        QVector<BinaryTableSource::Type> columns;
+        for (const auto &column: spec.value("columns").toArray()) {
+            columns.append(types.value(column.toString(), BinaryTableSource::Float32));
+        }
+        return std::unique_ptr<TableSource>(new BinaryTableSource(
+            spec.value("binary").toString(), columns,
+            static_cast<qint64>(spec.value("offset").toDouble(0)),
+            spec.value("precision").toInt(3)));
+    }
+
+    // Таблица измерений из файла любого размера:
+    // {"csv": "путь", "separator": ";", "headerRow": true} или
+    // {"binary": "путь", "columns": ["int16" | "int32" | "float32" | "float64", ...],
+    //  "offset": байт до первой записи, "precision": знаков после запятой},
+    // а также необязательные "header": [...], "formats": [...], "widths": [доли ширины].
+    // Строки идут из источника по одной, и каждая заполненная страница сразу рисуется
+    // (TableLayout держит только строки текущей страницы). Строки с другим числом
+    // ячеек дополняются пустыми ячейками или обрезаются по числу столбцов
+    static void renderTable(Pdf &doc, const QJsonObject &spec) {
+        const auto source = tableSource(spec);
+        QVector<QByteArray> header;
+        for (const auto &cell: spec.value("header").toArray()) {
+            header.append(cell.toString().toUtf8());
+        }
+        QVector<QByteArray> cells;
+        if (spec.value("headerRow").toBool(false) && source->next(cells) && header.isEmpty()) {
+            header = cells;
+        }
+        // Число столбцов - по заголовку или по первой строке
+        bool pending = false;
+        int columns = header.size();
+        if (columns == 0) {
+            pending = source->next(cells);
+            columns = cells.size();
+        }
+        if (columns == 0) return;
+        QVector<int> formats;
+        for (const auto &format: spec.value("formats").toArray()) {
+            formats.append(ReportTemplate::parseFormat(format));
+        }
+        formats.resize(columns);
+        for (int i = 0; i < columns; ++i) {
+            if (formats[i] == 0) {
+                formats[i] = Format::AlignHCenter | Format::AlignVCenter | Format::Small;
+            }
+        }
+        const QJsonArray widths = spec.value("widths").toArray();
+        QVector<qreal> borders{0};
+        for (int i = 0; i < columns; ++i) {
+            const qreal share = widths.size() == columns ? widths.at(i).toDouble()
+                                                         : 1.0 / columns;
+            borders.append(borders.last() + share * doc.width());
+        }
+        TableLayout layout(doc, borders, formats, header);
+        int row = 0;
+        int ragged = 0;
+        const auto add = [&] {
+            ++row;
+            if (cells.size() != columns) {
+                if (ragged++ == 0) {
+                    qWarning() << "Строка таблицы" << row << "содержит" << cells.size()
+                               << "ячеек вместо" << columns;
+                }
+                cells.resize(columns);
+            }
+            layout.addRow(cells);
+        };
+        if (pending) {
+            add();
+        }
+        while (!doc.isCancelled() && source->next(cells)) {
+            add();
+        }
+        layout.finish();
+        if (ragged > 1) {
+            qWarning() << "Строк таблицы с неверным числом ячеек:" << ragged;
+        }
+    }
+
+    // Страницы отчета в виде QPicture, без PDF. Все страницы остаются в памяти,
+    // поэтому таблица из файла здесь не выводится (см. layout)
+    RecordedReport record(const std::atomic_bool *cancelled = nullptr) const {
+        RecordedReport result;
+        QBuffer buffer;
+        Pdf doc(&buffer);
+        doc.recordOnly = true;
+        doc.cancelled = cancelled;
+        layout(doc);
+        doc.end();
+        result.pages = doc.recordedPages;
+        if (doc.writer) {
+            const QPageLayout pageLayout = doc.writer->pageLayout();
+            result.fullRect = pageLayout.fullRectPixels(doc.resolution());
+            result.paintRect = pageLayout.paintRectPixels(doc.resolution());
+            result.dpi = doc.resolution();
+        }
+        return result;
+    }
+
+    // Документ пишется прямо в device по мере разметки страниц
+    bool write(QIODevice *device, const std::atomic_bool *cancelled = nullptr,
+               const std::function<void(int)> &pageDone = {},
+               const Pdf::Output output = Pdf::PdfOutput) const {
+        bool ok;
+        //
+        {
+            Pdf doc(device, output);
+            ok = doc.writer != nullptr;
+            doc.cancelled = cancelled;
+            doc.pageDone = pageDone;
+            layout(doc);
+            ok = doc.end() && ok;
+        }
+#ifdef debug_
+        QD << DUMP(TextMeasureCache::global().hits.load())
+                << DUMP(TextMeasureCache::global().misses.load())
+                << DUMP(ImageCache::global().decodes.load());
+#endif
+        return ok;
+    }
+
+    QByteArray generate(const std::atomic_bool *cancelled = nullptr,
+                        const std::function<void(int)> &pageDone = {},
+                        const Pdf::Output output = Pdf::PdfOutput) const {
+        QByteArray pdfData;
+        QBuffer buffer(&pdfData);
+        write(&buffer, cancelled, pageDone, output);
+        return pdfData;
+    }
+};
+
+// Текст ошибки завершившегося lp или пустая строка
+static QString lpError(QProcess &lp) {
+    if (lp.error() == QProcess::FailedToStart) {
+        return "Не удалось запустить lp: " + lp.errorString();
+    }
+    if (lp.exitStatus() != QProcess::NormalExit || lp.exitCode() != 0) {
+        return "lp: " + QString::fromLocal8Bit(lp.readAllStandardError());
+    }
+    return {};
+}
+
+// Передает данные в lp и ждет его завершения (пакетный режим, не GUI-поток);
+// возвращает текст ошибки или пустую строку
+static QString submitToLp(const QByteArray &data, const QStringList &arguments) {
+    QProcess lp;
+    lp.start("lp", arguments);
+    if (!lp.waitForStarted()) {
+        return "Не удалось запустить lp: " + lp.errorString();
+    }
+    lp.write(data);
+    lp.closeWriteChannel();
+    lp.waitForFinished(-1);
+    return lpError(lp);
+}
+
+// Несколько отчетов одним заданием печати. Каждый отчет размечается один раз
+// (ReportJob::record), страницы всех отчетов идут подряд. Копии и подбор выполняет
+// принтер; если он этого не умеет, записанные страницы просто воспроизводятся повторно
+struct PrintBatch final {
+    QVector<RecordedReport> reports;
+    QSharedPointer<const Ppd> ppd;
+    QByteArray paper;
+    int copies = 1;
+    bool collate = true;
+
+    // Отчеты размечаются параллельно; PPD и бумага - из первого задания
+    static PrintBatch record(const QVector<ReportJob> &jobs) {
+        PrintBatch result;
+        QVector<QFuture<RecordedReport> > futures;
+        for (const ReportJob &job: jobs) {
+            futures.append(QtConcurrent::run([job] { return job.record(); }));
+        }
+        for (auto &future: futures) {
+            result.reports.append(future.result());
+        }
+        if (!jobs.isEmpty()) {
+            result.ppd = Ppd::load(jobs.first().ppdPath);
+            const auto report = ReportTemplate::load(jobs.first().templatePath);
+            if (report) result.paper = report->paper;
+        }
+        return result;
+    }
+
+    int pageCount() const {
+        int count = 0;
+        for (const auto &report: reports) {
+            count += report.pages.size();
+        }
+        return count * copies;
     }
 
-    void drawPageNumber() {
-        if (!writer) return;
-        const auto f = painter.font();
-        const QFont pageNumberFont("Times", 12);
-        painter.setFont(pageNumberFont);
-        const QFontMetrics pageNumberMetrics(pageNumberFont);
-        const int pageNumberWidth = pageNumberMetrics.horizontalAdvance(pageNumber);
-        const QRectF pageRect = writer->pageLayout().paintRectPixels(writer->resolution());
-        painter.drawText(
-            QPointF(pageRect.width() - pageNumberWidth - 20, pageRect.height() + 40),
-            QString("%1").arg(pageNumber));
-        painter.setFont(f);
+    // Порядок страниц задания: с подбором - весь пакет passes раз, без подбора -
+    // каждая страница passes раз подряд
+    template<typename F>
+    void forEachPage(const int passes, const F &f) const {
+        if (collate) {
+            for (int copy = 0; copy < passes; ++copy) {
+                for (const auto &report: reports) {
+                    for (int i = 0; i < report.pages.size(); ++i) f(report, i);
+                }
+            }
+        } else {
+            for (const auto &report: reports) {
+                for (int i = 0; i < report.pages.size(); ++i) {
+                    for (int copy = 0; copy < passes; ++copy) f(report, i);
+                }
+            }
+        }
     }
 
-    void newPage() {
-        if (!writer) return;
-        drawPageNumber();
-        writer->newPage();
-        pageNumber++;
-        posY = 0;
+    // Единственное преобразование альбомной страницы: если лист портретный, она
+    // поворачивается по часовой стрелке. Возвращает размер листа в новых координатах
+    static QSizeF orient(QPainter &painter, const QRectF &sheet, const QSizeF &page) {
+        if (page.width() > page.height() && sheet.width() < sheet.height()) {
+            painter.rotate(90.0);
+            painter.translate(0, -sheet.width());
+            return sheet.size().transposed();
+        }
+        return sheet.size();
     }
 
-    qreal width() const {
-        if (!writer) return 0;
-        return writer->width();
+    // Страница отчета на портретном листе sheet (пиксели устройства разрешения dpi):
+    // масштаб - отношение разрешений, альбомная страница поворачивается по часовой
+    // стрелке, как в Pdf::setPage
+    static void drawPage(QPainter &painter, const QRectF &sheet, const qreal dpi,
+                         const RecordedReport &report, const int pageIndex) {
+        const qreal scale = dpi / report.dpi;
+        painter.save();
+        orient(painter, sheet, report.fullRect.size());
+        painter.scale(scale, scale);
+        painter.translate(report.paintRect.topLeft());
+        painter.drawPicture(0, 0, report.pages[pageIndex]);
+        painter.restore();
     }
 
-    void setFont(const QFont &font) {
-        if (!writer) return;
-        painter.setFont(font);
+    bool print(QPrinter &printer) const {
+        printer.setFullPage(true);
+        printer.setPageOrientation(QPageLayout::Portrait);
+        if (ppd) {
+            printer.setResolution(ppd->resolution);
+        }
+        // Принтер сам печатает копии - страницы передаются один раз
+        const int passes = printer.supportsMultipleCopies() ? 1 : copies;
+        printer.setCopyCount(passes == 1 ? copies : 1);
+        printer.setCollateCopies(collate);
+        QPainter painter;
+        if (!painter.begin(&printer)) return false;
+        const QRectF sheet = printer.paperRect(QPrinter::DevicePixel);
+        bool first = true;
+        forEachPage(passes, [&](const RecordedReport &report, const int pageIndex) {
+            if (!first) printer.newPage();
+            first = false;
+            drawPage(painter, sheet, printer.resolution(), report, pageIndex);
+        });
+        painter.end();
+        return printer.printerState() != QPrinter::Error;
     }
 
-    void skip(const qreal i) {
-        posY += i;
+    // Весь пакет одним потоком PostScript; копии задаются в нем же (/NumCopies)
+    QByteArray postScript() const {
+        QByteArray data;
+        if (reports.isEmpty()) return data;
+        const RecordedReport &first = reports.first();
+        QSizeF sheet = first.fullRect.size();
+        if (sheet.width() > sheet.height()) {
+            sheet.transpose();
+        }
+        QBuffer buffer(&data);
+        buffer.open(QIODevice::WriteOnly);
+        PsWriter writer(&buffer);
+        writer.resolution = first.dpi;
+        writer.setPrinter(ppd.data(), paper);
+        writer.engine.copies = copies;
+        writer.engine.collate = collate;
+        writer.setPageLayout(QPageLayout(QPageSize(sheet * 72.0 / first.dpi, QPageSize::Point),
+                                         QPageLayout::Portrait, QMarginsF()));
+        QPainter painter(&writer);
+        bool firstPage = true;
+        forEachPage(1, [&](const RecordedReport &report, const int pageIndex) {
+            if (!firstPage) writer.newPage();
+            firstPage = false;
+            drawPage(painter, QRectF(QPointF(), sheet), first.dpi, report, pageIndex);
+        });
+        painter.end();
+        return data;
+    }
+};
+
+// Ограниченная очередь между потоком-производителем и потребителем: производитель
+// ждет, пока в очереди есть место, так что в памяти не больше capacity элементов
+template<typename T>
+struct BoundedQueue final {
+    QMutex mutex;
+    QWaitCondition notFull;
+    QWaitCondition notEmpty;
+    QQueue<T> items;
+    const int capacity;
+    bool closed = false;
+
+    explicit BoundedQueue(const int capacity): capacity(capacity) {
+    }
+
+    // false - очередь закрыта потребителем, продолжать не нужно
+    bool push(T item) {
+        QMutexLocker locker(&mutex);
+        while (items.size() >= capacity && !closed) {
+            notFull.wait(&mutex);
+        }
+        if (closed) return false;
+        items.enqueue(std::move(item));
+        notEmpty.wakeOne();
+        return true;
+    }
+
+    // false - за timeout мс ничего не пришло или очередь закрыта и пуста
+    bool pop(T &item, const int timeout) {
+        QMutexLocker locker(&mutex);
+        if (items.isEmpty() && !closed) {
+            notEmpty.wait(&mutex, timeout);
+        }
+        if (items.isEmpty()) return false;
+        item = items.dequeue();
+        notFull.wakeOne();
+        return true;
+    }
+
+    void close() {
+        QMutexLocker locker(&mutex);
+        closed = true;
+        notFull.wakeAll();
+        notEmpty.wakeAll();
+    }
+
+    bool isDrained() {
+        QMutexLocker locker(&mutex);
+        return closed && items.isEmpty();
     }
 };
 
+// Упорядоченное сглаживание (матрица Байера 8x8) для монохромных принтеров:
+// пороги для яркости 0..255
+static const uchar bayer8[8][8] = {
+    {0, 128, 32, 160, 8, 136, 40, 168},
+    {192, 64, 224, 96, 200, 72, 232, 104},
+    {48, 176, 16, 144, 56, 184, 24, 152},
+    {240, 112, 208, 80, 248, 120, 216, 88},
+    {12, 140, 44, 172, 4, 132, 36, 164},
+    {204, 76, 236, 108, 196, 68, 228, 100},
+    {60, 188, 28, 156, 52, 180, 20, 148},
+    {252, 124, 220, 92, 244, 116, 212, 84}
+};
+
+// Строка RGB32 -> строка Format_Mono (1 - черный). Без ветвлений по пикселям:
+// яркость и сравнение с порогом векторизуются компилятором
+static void ditherRow(const QRgb *src, uchar *dst, const int width, const uchar *threshold) {
+    const int fullBytes = width / 8;
+    for (int i = 0; i < fullBytes; ++i) {
+        const QRgb *p = src + i * 8;
+        uchar bits = 0;
+        for (int k = 0; k < 8; ++k) {
+            const uint luma = (qRed(p[k]) * 77 + qGreen(p[k]) * 150 + qBlue(p[k]) * 29) >> 8;
+            bits |= static_cast<uchar>((luma <= threshold[k]) << (7 - k));
+        }
+        dst[i] = bits;
+    }
+    if (const int rest = width % 8) {
+        const QRgb *p = src + fullBytes * 8;
+        uchar bits = 0;
+        for (int k = 0; k < rest; ++k) {
+            const uint luma = (qRed(p[k]) * 77 + qGreen(p[k]) * 150 + qBlue(p[k]) * 29) >> 8;
+            bits |= static_cast<uchar>((luma <= threshold[k]) << (7 - k));
+        }
+        dst[fullBytes] = bits;
+    }
+}
+
+// 1 бит на пиксель вместо 32: в 32 раза меньше данных для спулера
+static QImage ditherMono(const QImage &image) {
+    QImage rgb = image;
+    if (image.format() != QImage::Format_RGB32) {
+        // Прозрачные области считаются белой бумагой
+        rgb = QImage(image.size(), QImage::Format_RGB32);
+        rgb.fill(Qt::white);
+        QPainter p(&rgb);
+        p.drawImage(0, 0, image);
+    }
+    QImage mono(image.size(), QImage::Format_Mono);
+    mono.setColorTable({qRgb(255, 255, 255), qRgb(0, 0, 0)});
+    for (int y = 0; y < rgb.height(); ++y) {
+        ditherRow(reinterpret_cast<const QRgb *>(rgb.constScanLine(y)), mono.scanLine(y),
+                  rgb.width(), bayer8[y & 7]);
+    }
+    return mono;
+}
+
 struct PdfPrinter final : public QMainWindow {
     Q_OBJECT
 
@@ -851,6 +4329,11 @@ struct PdfPrinter final : public QMainWindow {
     QPushButton *openButton{};
 #endif
     QPushButton *printButton{};
+    QPushButton *signalButton{};
+    QJsonObject signalSpec; // выбранная запись сигнала для графика
+    QCheckBox *vectorPrintCheckBox{};
+    QCheckBox *postScriptCheckBox{};
+    int rasterQueueSize = 2; // готовых к печати страниц в памяти при растровой печати
     QWidget centralWidget{};
     QWidget *pageNavigationWidget{};
     QVBoxLayout *mainLayout{};
@@ -866,6 +4349,24 @@ struct PdfPrinter final : public QMainWindow {
     QByteArray pdfDataV;
     QByteArray pdfDataH;
     QPdfDocument document;
+    // Фоновая генерация: одновременно выполняется не больше одного задания. Запрос во
+    // время генерации отменяет текущее задание, и после его завершения запускается новое
+    std::shared_ptr<std::atomic_bool> cancelGeneration;
+    quint64 generation = 0;
+    bool generating = false;
+    bool regeneratePending = false;
+    bool runningSpeculative = false;
+    int runningOrientation = 0;
+    QByteArray runningKey;
+    bool showWhenReady = false;
+    // Ключи содержимого (ReportJob::contentKey) отчетов в pdfDataV и pdfDataH
+    QByteArray pdfKeyV;
+    QByteArray pdfKeyH;
+    // Живой просмотр: изменения текста и ориентации собираются таймером в один запуск
+    QCheckBox *liveCheckBox{};
+    QSpinBox *delaySpinBox{};
+    QTimer previewTimer;
+    QElapsedTimer previewLatency; // от первого необработанного изменения до показа
 
 public:
     static void _saveImage(QPdfDocument *document) {
@@ -901,6 +4402,14 @@ public:
         createPdf_B();
     }
 
+    ~PdfPrinter() override {
+        if (cancelGeneration) *cancelGeneration = true;
+        QThreadPool::globalInstance()->waitForDone();
+    }
+
+signals:
+    void pageGenerated(int page);
+
 public slots:
     void createPdf_B() {
         if (orientation->portraitRadio->isChecked()) {
@@ -908,112 +4417,30 @@ public slots:
         } else {
             orientation->state = 1;
         }
-        QBuffer *buffer = orientation->state == 0 ? &bufferV : &bufferH;
-        QByteArray*pdfData =orientation->state == 0 ? &pdfDataV : &pdfDataH;
-        //
-        {
-            using namespace Format;
-            pdfData->clear();
-            Pdf doc(buffer);
-            buffer->open(QIODevice::WriteOnly);
-            if (orientation->state == 0) {
-                doc.setPageSize(210 - 20 + 2, 297 - 20 + 2);
-            } else {
-                doc.setPageSize(297 - 20 + 2, 210 - 20 + 2);
+        previewTimer.stop();
+        ReportJob job = currentJob();
+        const QByteArray key = job.contentKey();
+        // Отчет уже готов (в том числе заранее построенный для другой ориентации)
+        if (*pdfKeyFor(job.orientation) == key) {
+            if (generating) {
+                *cancelGeneration = true;
             }
-            doc.setMargins(11, 11, 1, 11);
-            doc.begin();
-            //
-            {
-                using namespace Format;
-                doc.setFont(QFont("Times", 14));
-                qreal w = doc.width();
-                doc.addTableRow({0, 230, 300, w / 2 - 50, w / 2 + 50, w - 300, w - 230, w},
-                                {
-                                    "../res/CUSTOM.png",
-                                    "",
-                                    // "ООО «ВС Инжиниринг»\n©ВС Сигнал. Версия: 1.0.0",
-                                    "Справочные данные организации Заказчика",
-                                    "",
-                                    "ООО «ВС Инжиниринг»\n©ВС Сигнал. Версия: 1.0.0",
-                                    "",
-                                    "../res/VS.png"
-                                },
-                                {
-                                    Picture, 0,
-                                    AlignVCenter + AlignLeft + Italic + VUse, 0,
-                                    AlignVCenter + AlignRight + Italic + VUse, 0,
-                                    Picture
-                                },
-                                230);
-                doc.skip(40);
-                doc.addTableRow({150, 650, w}, {
-                                    "Источник данных:",
-                                    "Завод_Установка_Агрегат_Точка Измерения"
-                                }, {AlignBottom + VUse, AlignBottom + Italic + Small + VUse});
-                doc.addTableRow({150, 700, w}, {
-                                    "Дата и время печати:",
-                                    "ДД.ММ.ГГГГ чч:мм:сс"
-                                }, {AlignBottom + VUse, AlignBottom + Italic + Small + VUse});
-                doc.addTableRow({150, w}, {"Рассчитанные значения:"}, {AlignBottom + VUse});
-                doc.skip(20);
-                doc.addTableRow({
-                                    0, w / 9, 3 * w / 9, 4 * w / 9, 6 * w / 9,
-                                    7 * w / 9 + 100, w
-                                },
-                                {
-                                    " СКЗ:",
-                                    "______ед. изм.",
-                                    " Макс.:",
-                                    "______ед. изм.",
-                                    " Оборотная:",
-                                    "______ед. изм.",
-                                },
-                                {
-                                    AlignBottom + VUse, AlignBottom + Small + VUse,
-                                    AlignBottom + VUse, AlignBottom + Small + VUse,
-                                    AlignBottom + VUse, AlignBottom + Small + VUse
-                                },
-                                65, true);
-                doc.skip(100);
-                // doc.addTableRow({0, w}, {"../res/Plot.png"}, {Picture}, w);
-                //
-                {
-                    doc.painter.save();
-                    // ⚙️ ИЗМЕНЕНИЕ МАСШТАБА
-                    doc.painter.scale(2.2, 1);
-                    // 📐 ИЗМЕНЕНИЕ ПОЛОЖЕНИЯ
-                    doc.painter.translate(0, doc.posY);
-                    // 🖼️ Рендеринг виджета
-                    this->render(&doc.painter);
-                    doc.painter.restore();
-                }
-                doc.skip(1100);
-                doc.addTableRow({0, w}, {"Подпись рисунка"}, {
-                                    AlignBottom + AlignHCenter + Small + Italic
-                                }, -1, false, true);
-                doc.addTableRow({150, 750, w}, {
-                                    "Алгоритмы обработки:",
-                                    "ФНЧ 1000 Гц, ФВЧ 5 Гц"
-                                }, {AlignBottom + VUse, AlignBottom + Italic + Small + VUse});
-                doc.skip(50);
-                doc.addTableRow({150, w}, {"Примечание:"}, {AlignBottom + Italic + VUse});
-                doc.skip(-67);
-                doc.addText(0, w,
-                            "                                       " + textEdit->
-                            toPlainText().toUtf8(), Italic + Small);
-            }
-        }
-        _save(pdfData);
-        // Загружаем в документ
-        if (!buffer->open(QIODevice::ReadOnly)) {
-            QMessageBox::critical(this, "Ошибка", "Не удалось открыть буфер для чтения");
+            showPdf(job.orientation);
             return;
         }
-        document.load(buffer);
-        updatePageNavigation();
-        pdfView->repaint();
-        repaint();
+        if (generating) {
+            if (runningSpeculative && runningOrientation == job.orientation &&
+                runningKey == key) {
+                // Нужный отчет уже строится заранее - просто покажем его
+                showWhenReady = true;
+                return;
+            }
+            *cancelGeneration = true;
+            regeneratePending = true;
+            return;
+        }
+        captureFigure(job);
+        startGeneration(job, key, false);
     }
 
 private slots:
@@ -1036,12 +4463,19 @@ private slots:
             return;
         }
 
+        // Бумага, разрешение и цветность - из PPD принтера, как и при разметке отчета
+        const ReportJob job = currentJob();
+        const auto ppd = Ppd::load(job.ppdPath);
+        const auto report = ReportTemplate::load(job.templatePath);
+        const Ppd::Paper paper = ppd ? ppd->paper(report ? report->paper : QByteArray())
+                                     : Ppd::Paper();
+
         // Создаем принтер и диалог печати
         QPrinter printer(QPrinter::HighResolution);
         printer.setPageOrientation(orientation->state == 0
                                        ? QPageLayout::Orientation::Portrait
                                        : QPageLayout::Orientation::Landscape);
-        printer.setColorMode(QPrinter::Color);
+        printer.setColorMode(ppd && !ppd->colorDevice ? QPrinter::GrayScale : QPrinter::Color);
         printer.setCollateCopies(true);
         printer.setFullPage(true);
         printer.setCopyCount(1); //setNumCopies
@@ -1049,9 +4483,12 @@ private slots:
 
         QPageLayout pageLayout;
         // Устанавливаем мм как единицы измерения
-        pageLayout.setPageSize(QPageSize(QPageSize::A4)); // работает странно, не убирать
+        pageLayout.setPageSize(paper.isValid()
+                                   ? QPageSize(paper.size, QPageSize::Point)
+                                   : QPageSize(QPageSize::A4)); // работает странно, не убирать
         pageLayout.setUnits(QPageLayout::Millimeter);
-        pageLayout.setMargins(QMarginsF(9 + 4, 4 + 4, 1 + 4, 6 + 4)); // Отступы в мм
+        // Поля уже заложены в документ (Pdf::setPage), печатается лист целиком
+        pageLayout.setMargins(QMarginsF(0, 0, 0, 0));
         pageLayout.setOrientation(orientation->state == 0
                                       ? QPageLayout::Orientation::Portrait
                                       : QPageLayout::Orientation::Landscape);
@@ -1061,71 +4498,30 @@ private slots:
         printDialog.setWindowTitle("Печать документа");
         if (printDialog.exec() == QDialog::Accepted) {
             QD << printer.printerName();
+            if (postScriptCheckBox->isChecked() && !printer.printerName().isEmpty()) {
+                printPostScript(printer);
+                return;
+            }
+            if (ppd) {
+                // Иначе HighResolution дает 1200 dpi, и страницы пересчитываются драйвером
+                printer.setResolution(ppd->resolution);
+            }
             QPainter painter;
             if (!painter.begin(&printer)) {
                 QMessageBox::critical(this, "Ошибка", "Не удалось начать печать");
                 return;
             }
 
-            const bool isLandscape = orientation->state == 1;
-            // printer.pageLayout().orientation() ==
-            // QPageLayout::Landscape;
-
-            for (int pageIndex = 0; pageIndex < document.pageCount(); ++pageIndex) {
-                if (pageIndex > 0) {
-                    printer.newPage();
-                }
-
-                QSizeF pdfPageSize = document.pageSize(pageIndex);
-                QRectF printerRect = printer.pageRect(QPrinter::DevicePixel);
-
-                // Рассчитываем масштаб с учетом ориентации
-                qreal scaleX = printerRect.width() / pdfPageSize.width();
-                qreal scaleY = printerRect.height() / pdfPageSize.height();
-                const qreal scale = qMin(scaleX, scaleY);
-
-                // Размер для рендеринга с учетом масштаба и высокого DPI для качества
-                QSize renderSize(static_cast<int>(pdfPageSize.width() * scale * 2),
-                                 static_cast<int>(pdfPageSize.height() * scale * 2));
-
-                // Рендерим страницу PDF
-                QImage image = document.render(pageIndex, renderSize);
-
-                if (!image.isNull()) {
-                    painter.save(); // Сохраняем состояние painter
-
-                    if (isLandscape && printer.printerName() != "") {
-                        // Для альбомной ориентации поворачиваем систему координат
-                        painter.rotate(90.0); // Поворот на 90 градусов по часовой стрелке
-
-                        // Смещаем систему координат после поворота
-                        // Высота принтера становится новой шириной
-                        constexpr qreal C1 = 47.244094488;
-                        painter.translate(-44 * C1,
-                                          -printerRect.height() - 41 * C1);
-                    }
-
-                    // Позиционирование с центрированием (уже в повернутой системе координат)
-                    QPointF imagePos(
-                        (printerRect.width() - static_cast<double>(renderSize.width()) / 2) /
-                        2,
-                        (printerRect.height() - static_cast<double>(renderSize.height()) / 2)
-                        / 2
-                    );
-
-                    // Рисуем изображение
-                    painter.drawImage(
-                        QRectF(imagePos, QSizeF(static_cast<double>(renderSize.width()) / 2,
-                                                static_cast<double>(renderSize.height()) /
-                                                2)),
-                        image
-                    );
-
-                    painter.restore(); // Восстанавливаем состояние painter
-                }
+            if (vectorPrintCheckBox->isChecked()) {
+                printVector(printer, painter);
+            } else {
+                printRaster(printer, painter);
             }
 
             painter.end();
+            if (printer.printerState() == QPrinter::Aborted) {
+                return;
+            }
             QMessageBox::information(this, "Информация",
                                      "Документ отправлен на печать.\n"
                                      "Выбранный принтер: " + printer.printerName() + "\n" +
@@ -1161,6 +4557,245 @@ private slots:
     }
 
 private:
+    // delay - задержка перед запуском; повторный вызов до срабатывания ее перезапускает
+    void schedulePreview(const int delay) {
+        if (!previewLatency.isValid()) {
+            previewLatency.start();
+        }
+        previewTimer.start(delay);
+    }
+
+    // Печать PostScript: отчет размечается прямо в PostScript (PsWriter) с фрагментами
+    // setpagedevice из PPD и передается в lp; копии и подбор выполняет принтер
+    void printPostScript(const QPrinter &printer) {
+        ReportJob job = currentJob();
+        captureFigure(job);
+        const QByteArray ps = job.generate(nullptr, {}, Pdf::PostScriptOutput);
+        const QString printerName = printer.printerName();
+        const QStringList arguments = {
+            "-d", printerName, "-n", QString::number(printer.copyCount()),
+            "-o", printer.collateCopies() ? "collate=true" : "collate=false"
+        };
+        // lp работает асинхронно: зависший lp или CUPS не блокирует окно
+        auto *lp = new QProcess(this);
+        // finished или, если lp не запустился, errorOccurred - ровно один из них
+        const auto done = [this, lp, printerName] {
+            lp->deleteLater();
+            statusBar()->clearMessage();
+            const QString error = lpError(*lp);
+            if (!error.isEmpty()) {
+                QMessageBox::critical(this, "Ошибка", error);
+                return;
+            }
+            QMessageBox::information(this, "Информация",
+                                     "Документ отправлен на печать (PostScript).\n"
+                                     "Выбранный принтер: " + printerName);
+        };
+        connect(lp, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), this, done);
+        connect(lp, &QProcess::errorOccurred, this, [done](const QProcess::ProcessError e) {
+            if (e == QProcess::FailedToStart) done();
+        });
+        statusBar()->showMessage("Передача задания в lp...");
+        lp->start("lp", arguments);
+        lp->write(ps);
+        lp->closeWriteChannel();
+    }
+
+    // Векторная печать: страницы отчета записываются в QPicture тем же кодом разметки
+    // и воспроизводятся прямо на принтере, текст и таблицы не растеризуются
+    void printVector(QPrinter &printer, QPainter &painter) {
+        ReportJob job = currentJob();
+        captureFigure(job);
+        const RecordedReport report = job.record();
+        if (report.fullRect.isEmpty()) return;
+        // Страница документа - лист из PPD: то же размещение, что у пакетной печати
+        const QRectF printerRect = printer.paperRect(QPrinter::DevicePixel);
+        for (int pageIndex = 0; pageIndex < report.pages.size(); ++pageIndex) {
+            if (pageIndex > 0) {
+                printer.newPage();
+            }
+            PrintBatch::drawPage(painter, printerRect, printer.resolution(), report, pageIndex);
+        }
+    }
+
+    // Растровая печать. Страница рендерится ровно в разрешении принтера; монохромный
+    // принтер (в PPD Kyocera ColorDevice: False) получает 1-битное изображение.
+    // Страницы рендерятся в отдельном потоке, пока GUI-поток передает готовые принтеру;
+    // между ними не больше rasterQueueSize изображений
+    void printRaster(QPrinter &printer, QPainter &painter) {
+        const QPrinterInfo printerInfo(printer);
+        const bool mono = printer.colorMode() == QPrinter::GrayScale ||
+                          (!printerInfo.isNull() &&
+                           !printerInfo.supportedColorModes().contains(QPrinter::Color));
+        const QRectF printerRect = printer.paperRect(QPrinter::DevicePixel);
+        const int pageCount = document.pageCount();
+
+        // Размер для рендеринга: один пиксель изображения на точку принтера
+        QVector<QSize> renderSizes;
+        for (int pageIndex = 0; pageIndex < pageCount; ++pageIndex) {
+            const QSizeF pdfPageSize = document.pageSize(pageIndex); // пункты
+            const qreal scale = printer.resolution() / 72.0;
+            renderSizes.append(QSize(static_cast<int>(pdfPageSize.width() * scale),
+                                     static_cast<int>(pdfPageSize.height() * scale)));
+        }
+
+        // pdfium не допускает параллельного рендеринга, поэтому поток один, со своим
+        // экземпляром документа
+        BoundedQueue<QImage> queue(rasterQueueSize);
+        const QByteArray pdfData = orientation->state == 0 ? pdfDataV : pdfDataH;
+        QFuture<void> producer = QtConcurrent::run([&queue, pdfData, renderSizes, mono] {
+            QBuffer buffer;
+            buffer.setData(pdfData);
+            buffer.open(QIODevice::ReadOnly);
+            QPdfDocument pdf;
+            pdf.load(&buffer);
+            for (int pageIndex = 0; pageIndex < renderSizes.size(); ++pageIndex) {
+                QImage image = pdf.render(pageIndex, renderSizes[pageIndex]);
+                if (mono && !image.isNull()) {
+                    image = ditherMono(image);
+                }
+                if (!queue.push(image)) break;
+            }
+            queue.close();
+        });
+
+        QProgressDialog progress("Печать документа...", "Отмена", 0, pageCount, this);
+        progress.setWindowModality(Qt::WindowModal);
+        progress.setMinimumDuration(0);
+        for (int pageIndex = 0; pageIndex < pageCount; ++pageIndex) {
+            progress.setValue(pageIndex);
+            QImage image;
+            bool received = false;
+            while (!progress.wasCanceled() && !(received = queue.pop(image, 50)) &&
+                   !queue.isDrained()) {
+                QCoreApplication::processEvents();
+            }
+            if (!received || progress.wasCanceled()) break;
+
+            if (pageIndex > 0) {
+                printer.newPage();
+            }
+            if (!image.isNull()) {
+                painter.save(); // Сохраняем состояние painter
+                const QSizeF sheet = PrintBatch::orient(painter, printerRect, image.size());
+
+                // Позиционирование с центрированием (уже в повернутой системе координат)
+                QPointF imagePos(
+                    (sheet.width() - image.width()) / 2,
+                    (sheet.height() - image.height()) / 2
+                );
+
+                // Рисуем изображение без масштабирования
+                painter.drawImage(imagePos, image);
+
+                painter.restore(); // Восстанавливаем состояние painter
+            }
+        }
+        if (progress.wasCanceled()) {
+            printer.abort();
+        }
+        // Закрытие очереди будит поток рендеринга, если он ждет места
+        queue.close();
+        producer.waitForFinished();
+        progress.setValue(pageCount);
+    }
+
+    ReportJob currentJob() const {
+        ReportJob job;
+        job.orientation = orientation->state;
+        job.note = textEdit->toPlainText();
+        job.signalSpec = signalSpec;
+        return job;
+    }
+
+    // Виджеты можно рисовать только в GUI-потоке
+    void captureFigure(ReportJob &job) {
+        const auto report = ReportTemplate::load(job.templatePath);
+        if (!report || !report->usesFigure) return;
+        QPainter picturePainter(&job.figure);
+        this->render(&picturePainter);
+    }
+
+    QByteArray *pdfKeyFor(const int state) {
+        return state == 0 ? &pdfKeyV : &pdfKeyH;
+    }
+
+    // speculative - заранее строится отчет другой ориентации, он только сохраняется
+    void startGeneration(const ReportJob &job, const QByteArray &key, const bool speculative) {
+        const auto cancelled = std::make_shared<std::atomic_bool>(false);
+        cancelGeneration = cancelled;
+        generating = true;
+        runningSpeculative = speculative;
+        runningOrientation = job.orientation;
+        runningKey = key;
+        showWhenReady = !speculative;
+        const quint64 id = ++generation;
+
+        auto *watcher = new QFutureWatcher<QByteArray>(this);
+        connect(watcher, &QFutureWatcher<QByteArray>::finished, this,
+                [this, watcher, id, job, key, cancelled, speculative] {
+                    watcher->deleteLater();
+                    generating = false;
+                    if (regeneratePending) {
+                        regeneratePending = false;
+                        createPdf_B();
+                        return;
+                    }
+                    // Результат устаревшего задания не показываем
+                    if (id != generation || *cancelled) return;
+                    const QByteArray pdfData = watcher->result();
+                    storePdf(job.orientation, pdfData, key);
+                    // tmp.pdf пишет только GUI-поток: отмененное задание до него не доходит
+                    if (!speculative) _save(&pdfData);
+                    if (!showWhenReady) return;
+                    showPdf(job.orientation);
+                    // Пока пользователь смотрит отчет, строим другую ориентацию
+                    ReportJob other = job;
+                    other.orientation = 1 - job.orientation;
+                    if (*pdfKeyFor(other.orientation) != key) {
+                        startGeneration(other, key, true);
+                    }
+                });
+        watcher->setFuture(QtConcurrent::run([this, job, cancelled, speculative] {
+            return job.generate(cancelled.get(), [this, cancelled, speculative](int page) {
+                if (!*cancelled && !speculative) emit pageGenerated(page);
+            });
+        }));
+    }
+
+    // Буфер ориентации, которая сейчас не показана, можно перезаписывать
+    void storePdf(const int state, const QByteArray &data, const QByteArray &key) {
+        QBuffer *buffer = state == 0 ? &bufferV : &bufferH;
+        QByteArray *pdfData = state == 0 ? &pdfDataV : &pdfDataH;
+        buffer->close();
+        *pdfData = data;
+        *pdfKeyFor(state) = key;
+    }
+
+    // Готовый отчет подменяет предпросмотр целиком, в GUI-потоке
+    void showPdf(const int state) {
+        QBuffer *buffer = state == 0 ? &bufferV : &bufferH;
+        buffer->close();
+        // Загружаем в документ
+        if (!buffer->open(QIODevice::ReadOnly)) {
+            QMessageBox::critical(this, "Ошибка", "Не удалось открыть буфер для чтения");
+            return;
+        }
+        document.load(buffer);
+        updatePageNavigation();
+        pdfView->repaint();
+        repaint();
+        if (previewLatency.isValid()) {
+            const qint64 latency = previewLatency.elapsed();
+            previewLatency.invalidate();
+            QD << DUMP(latency);
+            statusBar()->showMessage(QString("Готово, страниц: %1, задержка обновления: %2 мс")
+                .arg(document.pageCount()).arg(latency));
+        } else {
+            statusBar()->showMessage(QString("Готово, страниц: %1").arg(document.pageCount()));
+        }
+    }
+
     QWidget *setupPageNavigation() {
         // Панель навигации по страницам
         pageLabel = new QLabel("Страница:", this);
@@ -1184,11 +4819,25 @@ private:
         buttonLayout = new QHBoxLayout();
         buttonLayout->addWidget(orientation = new OrientationWidget(this));
         buttonLayout->addWidget(createButton = new QPushButton("Изменить Примечание"));
+        buttonLayout->addWidget(liveCheckBox = new QCheckBox("Живой просмотр"));
+        buttonLayout->addWidget(delaySpinBox = new QSpinBox());
+        liveCheckBox->setChecked(true);
+        delaySpinBox->setRange(0, 5000);
+        delaySpinBox->setSingleStep(50);
+        delaySpinBox->setValue(300);
+        delaySpinBox->setSuffix(" мс");
+        delaySpinBox->setToolTip("Задержка обновления после изменения текста");
 #ifdef debug_
         buttonLayout->addWidget(openButton = new QPushButton("Открыть PDF"));
 #endif
+        buttonLayout->addWidget(signalButton = new QPushButton("Сигнал..."));
+        signalButton->setToolTip("Запись сигнала для графика: *.i16 - int16, иначе float32");
         buttonLayout->addWidget(setupPageNavigation());
         buttonLayout->addWidget(printButton = new QPushButton("Печать"));
+        buttonLayout->addWidget(vectorPrintCheckBox = new QCheckBox("Векторная печать"));
+        vectorPrintCheckBox->setChecked(true);
+        buttonLayout->addWidget(postScriptCheckBox = new QCheckBox("PostScript"));
+        postScriptCheckBox->setToolTip("Отправить отчет в lp в виде PostScript, без PDF");
         buttonLayout->addStretch();
         return buttonLayout;
     }
@@ -1232,11 +4881,24 @@ private:
     }
 
     void setupConnections() {
-        connect(createButton, &QPushButton::clicked, this, &PdfPrinter::createPdf_B);
+        connect(createButton, &QPushButton::clicked, this, [this] { schedulePreview(0); });
 #ifdef debug_
         connect(openButton, &QPushButton::clicked, this, &PdfApp::openPdf);
 #endif
         connect(printButton, &QPushButton::clicked, this, &PdfPrinter::printPdf);
+        connect(signalButton, &QPushButton::clicked, this, [this] {
+            const QString fileName = QFileDialog::getOpenFileName(
+                this, "Запись сигнала", "", "Сигналы (*.f32 *.i16 *.raw);;Все файлы (*)");
+            if (fileName.isEmpty()) return;
+            signalSpec = {
+                {"path", fileName},
+                {"type", QFileInfo(fileName).suffix() == "i16" ? "int16" : "float32"}
+            };
+            schedulePreview(0);
+        });
+        connect(this, &PdfPrinter::pageGenerated, this, [this](const int page) {
+            statusBar()->showMessage(QString("Формирование отчета: страница %1").arg(page));
+        });
         connect(pageSpinBox, QOverload<int>::of(&QSpinBox::valueChanged),
                 this, &PdfPrinter::onPageChanged);
         connect(&document, &QPdfDocument::statusChanged, this,
@@ -1270,10 +4932,23 @@ private:
         //     }
         //     createPdf_B();
         // });
+        // toggled приходит от обеих радиокнопок; таймер сводит их в один запуск
         connect(orientation->portraitRadio, &QRadioButton::toggled, this,
-                &PdfPrinter::createPdf_B);
+                [this] { schedulePreview(0); });
         connect(orientation->landscapeRadio, &QRadioButton::toggled, this,
-                &PdfPrinter::createPdf_B);
+                [this] { schedulePreview(0); });
+        previewTimer.setSingleShot(true);
+        connect(&previewTimer, &QTimer::timeout, this, &PdfPrinter::createPdf_B);
+        connect(textEdit, &QTextEdit::textChanged, this, [this] {
+            if (liveCheckBox->isChecked()) {
+                schedulePreview(delaySpinBox->value());
+            }
+        });
+        connect(delaySpinBox, QOverload<int>::of(&QSpinBox::valueChanged), this, [this] {
+            if (previewTimer.isActive()) {
+                previewTimer.start(delaySpinBox->value());
+            }
+        });
     }
 #ifdef debug_
     void loadPdfForView(const QString &fileName) {
@@ -1293,6 +4968,7 @@ private:
 #include <QDateTime>
 #include <execinfo.h>   // Для backtrace
 #include <cxxabi.h>     // Для деманглинга имен функций
+#include <sys/resource.h> // getrusage для бенчмарков
 
 void printBacktrace() {
     constexpr int maxFrames = 20;
@@ -1377,8 +5053,533 @@ void myMessageHandler(const QtMsgType type, const QMessageLogContext &context,
     fflush(stderr);
 }
 
+// Пакетный режим: отчеты по списку заданий без главного окна
+static int runBatch(const QStringList &arguments) {
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Пакетное формирование отчетов");
+    parser.addHelpOption();
+    const QCommandLineOption batchOption("batch", "Файл заданий (JSON-массив).", "file");
+    const QCommandLineOption outOption("out", "Каталог для PDF.", "dir", ".");
+    const QCommandLineOption jobsOption(QStringList{"j", "jobs"},
+                                        "Число заданий, выполняемых параллельно.", "n",
+                                        QString::number(QThread::idealThreadCount()));
+    const QCommandLineOption quietOption("quiet", "Без отладочного вывода.");
+    const QCommandLineOption formatOption("format", "Формат отчетов: pdf или ps.", "format",
+                                          "pdf");
+    const QCommandLineOption printOption("print",
+                                         "Напечатать все отчеты одним заданием на принтере.",
+                                         "printer");
+    const QCommandLineOption copiesOption("copies", "Число копий пакета.", "n", "1");
+    const QCommandLineOption noCollateOption("no-collate", "Печатать копии без подбора.");
+    parser.addOptions({
+        batchOption, outOption, jobsOption, quietOption, formatOption, printOption,
+        copiesOption, noCollateOption
+    });
+    parser.process(arguments);
+    debug = !parser.isSet(quietOption);
+
+    QFile file(parser.value(batchOption));
+    if (!file.open(QIODevice::ReadOnly)) {
+        fprintf(stderr, "Ошибка открытия файла заданий: %s\n",
+                file.errorString().toLocal8Bit().constData());
+        return 1;
+    }
+    QJsonParseError error{};
+    const QJsonDocument json = QJsonDocument::fromJson(file.readAll(), &error);
+    if (!json.isArray()) {
+        fprintf(stderr, "Ошибка разбора файла заданий: %s\n",
+                error.errorString().toLocal8Bit().constData());
+        return 1;
+    }
+    const QDir outDir(parser.value(outOption));
+    if (!outDir.mkpath(".")) {
+        fprintf(stderr, "Не удалось создать каталог %s\n",
+                outDir.path().toLocal8Bit().constData());
+        return 1;
+    }
+
+    const bool postScript = parser.value(formatOption) == "ps";
+    const Pdf::Output output = postScript ? Pdf::PostScriptOutput : Pdf::PdfOutput;
+    QThreadPool::globalInstance()->setMaxThreadCount(qMax(1, parser.value(jobsOption).toInt()));
+    const QJsonArray jobs = json.array();
+    if (parser.isSet(printOption)) {
+        QVector<ReportJob> batchJobs;
+        for (const auto &o: jobs) {
+            batchJobs.append(ReportJob::fromJson(o.toObject()));
+        }
+        PrintBatch batch = PrintBatch::record(batchJobs);
+        batch.copies = qMax(1, parser.value(copiesOption).toInt());
+        batch.collate = !parser.isSet(noCollateOption);
+        const QString printerName = parser.value(printOption);
+        if (postScript) {
+            const QString error = submitToLp(batch.postScript(), {"-d", printerName});
+            if (!error.isEmpty()) {
+                fprintf(stderr, "%s\n", error.toLocal8Bit().constData());
+                return 1;
+            }
+        } else {
+            QPrinter printer(QPrinterInfo::printerInfo(printerName), QPrinter::HighResolution);
+            if (!printer.isValid() || !batch.print(printer)) {
+                fprintf(stderr, "Ошибка печати на %s\n", printerName.toLocal8Bit().constData());
+                return 1;
+            }
+        }
+        fprintf(stderr, "Отчетов: %d, страниц: %d\n", batch.reports.size(), batch.pageCount());
+        return 0;
+    }
+    QVector<QFuture<bool> > results;
+    for (int i = 0; i < jobs.size(); ++i) {
+        const QJsonObject o = jobs[i].toObject();
+        const ReportJob job = ReportJob::fromJson(o);
+        const QString fileName = outDir.filePath(
+            o.value("output").toString(QString("report_%1.%2").arg(i + 1, 4, 10, QChar('0'))
+                                           .arg(postScript ? "ps" : "pdf")));
+        results.append(QtConcurrent::run([job, fileName, output] {
+            // Прямо в файл: длинная таблица не копится в памяти
+            QFile out(fileName);
+            return job.write(&out, nullptr, {}, output) && out.error() == QFileDevice::NoError;
+        }));
+    }
+    int failed = 0;
+    for (int i = 0; i < results.size(); ++i) {
+        if (!results[i].result()) {
+            fprintf(stderr, "Задание %d: ошибка записи отчета\n", i + 1);
+            ++failed;
+        }
+    }
+    fprintf(stderr, "Отчетов: %d, ошибок: %d\n", results.size(), failed);
+    return failed > 0 ? 1 : 0;
+}
+
+#ifdef REPORT_BENCHMARK
+// Бенчмарки разметки (цель report_bench): Pdf пишет в память без окна, каждый
+// случай повторяется не меньше --min-time мс. Результат - строка JSON на случай:
+// ns/op, страниц в секунду, байт документа и пиковая резидентная память процесса
+struct Benchmark final {
+    // Итог одного прогона: операций (для микробенчмарков - внутренних повторов),
+    // страниц и байт документа
+    struct Run {
+        qint64 ops = 1;
+        int pages = 0;
+        qint64 bytes = 0;
+    };
+
+    QString filter;
+    qint64 minTimeNs = 200000000;
+    QTemporaryDir dir;
+    QString imagePath;
+    QVector<float> waveform;
+
+    static qint64 peakRssKb() {
+#ifdef Q_OS_UNIX
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+#else
+        return 0;
+#endif
+    }
+
+    static QString words(const int count) {
+        static const QStringList vocabulary = {
+            "вибрация", "подшипник", "агрегат", "измерение", "спектр", "ротор",
+            "амплитуда", "частота", "датчик", "насос", "вал", "норма"
+        };
+        QStringList result;
+        for (int i = 0; i < count; ++i) {
+            result.append(vocabulary[(i * 7 + i / 3) % vocabulary.size()]);
+        }
+        return result.join(' ');
+    }
+
+    template<typename F>
+    void run(const QString &name, F op) {
+        if (!filter.isEmpty() && !name.contains(filter)) return;
+        op(); // прогрев кэшей
+        QElapsedTimer timer;
+        timer.start();
+        qint64 iterations = 0;
+        Run total;
+        total.ops = 0;
+        do {
+            const Run r = op();
+            total.ops += r.ops;
+            total.pages += r.pages;
+            total.bytes = r.bytes;
+            ++iterations;
+        } while (timer.nsecsElapsed() < minTimeNs);
+        const double seconds = timer.nsecsElapsed() / 1e9;
+        const QJsonObject result{
+            {"name", name},
+            {"iterations", iterations},
+            {"ns_per_op", timer.nsecsElapsed() / static_cast<double>(total.ops)},
+            {"pages_per_s", total.pages / seconds},
+            {"bytes", total.bytes},
+            {"peak_rss_kb", peakRssKb()}
+        };
+        printf("%s\n", QJsonDocument(result).toJson(QJsonDocument::Compact).constData());
+        fflush(stdout);
+    }
+
+    // Страница A4 с полями шаблона по умолчанию
+    static void begin(Pdf &doc, const bool landscape) {
+        const QSizeF a4(210, 297);
+        doc.setPageSize(landscape ? a4.transposed() : a4);
+        doc.setMargins(QMarginsF(20, 20, 10, 20));
+        doc.begin();
+        doc.setFont(QFont("Times", 14));
+    }
+
+    // Документ целиком (см. begin); f рисует содержимое
+    template<typename F>
+    static Run document(const bool landscape, F f) {
+        QByteArray data;
+        QBuffer buffer(&data);
+        Run result;
+        //
+        {
+            Pdf doc(&buffer);
+            begin(doc, landscape);
+            f(doc);
+            doc.end();
+            result.pages = doc.pageNumber;
+        }
+        result.bytes = data.size();
+        return result;
+    }
+
+    static QVector<qreal> borders(const Pdf &doc, const int columns) {
+        QVector<qreal> result;
+        for (int i = 0; i <= columns; ++i) {
+            result.append(doc.width() * i / columns);
+        }
+        return result;
+    }
+
+    void text(const bool landscape) {
+        const QString suffix = landscape ? "_landscape" : "_portrait";
+        const QByteArray shortNote = words(20).toUtf8();
+        const QByteArray longNote = words(20000).toUtf8();
+        run("add_text_short" + suffix, [&] {
+            return document(landscape, [&](Pdf &doc) {
+                doc.addText(0, doc.width(), shortNote, Format::Italic | Format::Small);
+            });
+        });
+        run("add_text_long" + suffix, [&] {
+            return document(landscape, [&](Pdf &doc) {
+                doc.addText(0, doc.width(), longNote, Format::Italic | Format::Small);
+            });
+        });
+        QVector<QByteArray> lines;
+        QVector<int> formats;
+        for (int i = 0; i < 200; ++i) {
+            lines.append(words(10).toUtf8() + ' ');
+            formats.append(i % 3 == 0 ? Format::Bold : Format::Small);
+        }
+        run("add_paragraph" + suffix, [&] {
+            return document(landscape, [&](Pdf &doc) {
+                doc.addParagraph(0, doc.width(), lines, formats);
+            });
+        });
+    }
+
+    void tables(const bool landscape) {
+        const QString suffix = landscape ? "_landscape" : "_portrait";
+        const QVector<int> formats{
+            Format::AlignVCenter | Format::AlignLeft | Format::Small,
+            Format::AlignVCenter | Format::AlignHCenter | Format::Small,
+            Format::AlignVCenter | Format::AlignRight | Format::Italic
+        };
+        for (const int rows: {10, 1000, 10000}) {
+            QVector<QVector<QByteArray> > cells;
+            for (int i = 0; i < rows; ++i) {
+                cells.append({
+                    QByteArray::number(i + 1), words(3 + i % 5).toUtf8(),
+                    QByteArray::number(i * 0.125, 'f', 3)
+                });
+            }
+            run(QString("add_table_row_%1%2").arg(rows).arg(suffix), [&] {
+                Run r = document(landscape, [&](Pdf &doc) {
+                    const QVector<qreal> b = borders(doc, 3);
+                    for (const auto &row: cells) {
+                        doc.addTableRow(b, row, formats, -1, true);
+                    }
+                });
+                r.ops = rows;
+                return r;
+            });
+            run(QString("table_layout_%1%2").arg(rows).arg(suffix), [&] {
+                Run r = document(landscape, [&](Pdf &doc) {
+                    TableLayout::render(doc, borders(doc, 3), formats,
+                                        {"№", "Описание", "Значение"}, cells);
+                });
+                r.ops = rows;
+                return r;
+            });
+        }
+        run("add_table_row_images" + suffix, [&] {
+            const QVector<int> imageFormats{
+                Format::Picture | Format::AlignHCenter, Format::AlignVCenter | Format::Small,
+                Format::Picture | Format::AlignHCenter
+            };
+            Run r = document(landscape, [&](Pdf &doc) {
+                const QVector<qreal> b = borders(doc, 3);
+                for (int i = 0; i < 100; ++i) {
+                    doc.addTableRow(b, {imagePath.toUtf8(), words(4).toUtf8(),
+                                        imagePath.toUtf8()}, imageFormats, 200, true);
+                }
+            });
+            r.ops = 100;
+            return r;
+        });
+    }
+
+    // Стоимость оформления ячейки: сборка QFont по формату (как до таблицы стилей)
+    // и поиск в Pdf::style. Документ общий и создается до замеров, ns/op - на ячейку
+    void cells() {
+        QByteArray data;
+        QBuffer buffer(&data);
+        Pdf doc(&buffer);
+        begin(doc, false);
+        const int count = 10000;
+        run("cell_font_build", [&] {
+            Run r;
+            for (int i = 0; i < count; ++i) {
+                const int format = (i % 2 ? Format::Italic : Format::Bold) |
+                                   (i % 3 ? Format::Small : 0);
+                const QFont defaultFont = doc.painter.font();
+                QFont font = doc.painter.font();
+                font.setPointSize(format & Format::Small ? 12 : 14);
+                if (format & Format::Italic) font.setItalic(true);
+                if (format & Format::Bold) font.setBold(true);
+                doc.painter.setFont(font);
+                doc.painter.setFont(defaultFont);
+            }
+            r.ops = count;
+            return r;
+        });
+        run("cell_style_lookup", [&] {
+            Run r;
+            for (int i = 0; i < count; ++i) {
+                const int format = (i % 2 ? Format::Italic : Format::Bold) |
+                                   (i % 3 ? Format::Small : 0);
+                const QFont defaultFont = doc.painter.font();
+                doc.painter.setFont(doc.style(format).font);
+                doc.painter.setFont(defaultFont);
+            }
+            r.ops = count;
+            return r;
+        });
+        const QString text = words(2000);
+        run("split_text_by_height", [&] {
+            Run r;
+            for (int i = 0; i < 100; ++i) {
+                doc.splitTextByHeight(text, doc.width() / 2, doc.pageHeight / 3);
+            }
+            r.ops = 100;
+            return r;
+        });
+        doc.end();
+    }
+
+    void reports() {
+        for (const int orientation: {0, 1}) {
+            const QString suffix = orientation ? "_landscape" : "_portrait";
+            for (const int noteWords: {20, 20000}) {
+                ReportJob job;
+                job.orientation = orientation;
+                job.note = words(noteWords);
+                run(QString("report_%1%2").arg(noteWords > 100 ? "long" : "short").arg(suffix),
+                    [&] {
+                        Run r;
+                        r.bytes = job.generate(nullptr, [&r](const int page) {
+                            r.pages = page;
+                        }).size();
+                        return r;
+                    });
+            }
+        }
+    }
+
+    void processing() {
+        const auto samples = Signal::fromSamples(waveform, 25600, "мм/с", "bench");
+        // Здесь ns/op - на отсчет и на весь спектр, документа нет
+        run("signal_stats_10M", [&] {
+            Run r;
+            SignalStats::compute(waveform.constData(), waveform.size());
+            r.ops = waveform.size();
+            return r;
+        });
+        run("signal_spectrum_8192", [&] {
+            Fft::plan(8192)->amplitude(waveform.constData(), waveform.size());
+            return Run();
+        });
+        run("waveform_plot", [&] {
+            return document(false, [&](Pdf &doc) {
+                Plot::draw(doc.painter, QRectF(0, 0, doc.width(), 1100), samples.data());
+            });
+        });
+    }
+
+    static bool expect(const bool ok, const QString &what) {
+        if (!ok) {
+            fprintf(stderr, "Самопроверка не пройдена: %s\n", what.toLocal8Bit().constData());
+        }
+        return ok;
+    }
+
+    // Ядра SignalStats (скалярное, SSE2, AVX2 - какие есть у процессора) против
+    // расчета в double. exact - данные целые и малые, суммы во float точны
+    template<typename T>
+    static bool checkKernels(const QString &name, const QVector<T> &data, const bool exact) {
+        double sum = 0;
+        double absSum = 0;
+        double squares = 0;
+        float lo = std::numeric_limits<float>::max();
+        float hi = std::numeric_limits<float>::lowest();
+        for (const T v: data) {
+            sum += v;
+            absSum += qAbs(static_cast<double>(v));
+            squares += static_cast<double>(v) * v;
+            lo = qMin(lo, static_cast<float>(v));
+            hi = qMax(hi, static_cast<float>(v));
+        }
+        QVector<QPair<QString, SignalStats::Sums> > results;
+        SignalStats::Sums sums;
+        SignalStats::scalar(data.constData(), data.size(), sums);
+        results.append({"scalar", sums});
+#if defined(Q_PROCESSOR_X86) && (defined(Q_PROCESSOR_X86_64) || defined(__SSE2__))
+        sums = SignalStats::Sums();
+        SignalStats::sse2(data.constData(), data.size(), sums);
+        results.append({"sse2", sums});
+#ifdef Q_CC_GNU
+        if (SignalStats::hasAvx2()) {
+            sums = SignalStats::Sums();
+            SignalStats::avx2(data.constData(), data.size(), sums);
+            results.append({"avx2", sums});
+        }
+#endif
+#endif
+        // Граница ошибки: floatBlockSize / 8 сложений в элементе вектора SSE2, округление
+        // квадрата и сложение двух векторов - по половине эпсилон float каждое
+        const double tolerance = exact ? 0 : (SignalStats::floatBlockSize / 8 + 2) *
+                                             std::numeric_limits<float>::epsilon() / 2;
+        bool ok = true;
+        for (const auto &result: results) {
+            const SignalStats::Sums &r = result.second;
+            ok &= expect(r.min == lo && r.max == hi &&
+                         qAbs(r.sum - sum) <= tolerance * absSum &&
+                         qAbs(r.squares - squares) <= tolerance * squares,
+                         QString("%1 %2: сумма %3 (%4), квадраты %5 (%6), min %7 (%8), "
+                                 "max %9 (%10)").arg(name, result.first)
+                             .arg(r.sum, 0, 'g', 17).arg(sum, 0, 'g', 17)
+                             .arg(r.squares, 0, 'g', 17).arg(squares, 0, 'g', 17)
+                             .arg(r.min).arg(lo).arg(r.max).arg(hi));
+        }
+        return ok;
+    }
+
+    // Самопроверки перед замерами: при расхождении замеры не запускаются, код
+    // возврата 1. Проверяются тон в спектре и совпадение ядер SignalStats
+    bool selfCheck() const {
+        bool ok = true;
+        // Тон 1 кГц амплитудой 3 при 25600 Гц попадает точно в бин 320 БПФ 8192
+        QVector<float> tone(8192 * 16);
+        for (int i = 0; i < tone.size(); ++i) {
+            tone[i] = static_cast<float>(3 * std::sin(2 * M_PI * 1000 * i / 25600));
+        }
+        const QVector<float> amplitude = Fft::plan(8192)->amplitude(tone.constData(),
+                                                                    tone.size());
+        const int peak = static_cast<int>(std::max_element(amplitude.begin(), amplitude.end()) -
+                                          amplitude.begin());
+        ok &= expect(peak == 320 && qAbs(amplitude[peak] - 3) < 0.01,
+                     QString("спектр тона 1 кГц: %1 в бине %2, ожидалось 3 в бине 320")
+                         .arg(amplitude.value(peak)).arg(peak));
+
+        // Длина не кратна ширине векторов; минимум - в хвосте, максимум - в середине
+        const int n = 3 * SignalStats::blockSize + 13;
+        QVector<float> small(n);
+        QVector<qint16> ints(n);
+        for (int i = 0; i < n; ++i) {
+            small[i] = static_cast<float>((i * 7) % 16);
+            ints[i] = static_cast<qint16>(i % 5 == 0 ? -32768 : (i * 2654435761u) >> 16);
+        }
+        small[n / 2] = 17;
+        small[n - 1] = -1;
+        ints[n / 2] = 32767;
+        // Пара -32768 дает в _mm_madd_epi16 ровно 2^31
+        ints[10] = ints[11] = -32768;
+        ok &= checkKernels("signal_stats float", small, true);
+        ok &= checkKernels("signal_stats int16", ints, true);
+        ok &= checkKernels("signal_stats waveform", waveform, false);
+        return ok;
+    }
+
+    int exec(const QStringList &arguments) {
+        QCommandLineParser parser;
+        parser.setApplicationDescription("Бенчмарки разметки отчета");
+        parser.addHelpOption();
+        const QCommandLineOption filterOption("filter", "Только случаи, имя которых содержит "
+                                              "подстроку.", "text");
+        const QCommandLineOption minTimeOption("min-time", "Минимальное время случая, мс.",
+                                               "ms", "200");
+        parser.addOptions({filterOption, minTimeOption});
+        parser.process(arguments);
+        filter = parser.value(filterOption);
+        minTimeNs = parser.value(minTimeOption).toLongLong() * 1000000;
+
+        QImage image(600, 400, QImage::Format_RGB32);
+        image.fill(Qt::white);
+        //
+        {
+            QPainter painter(&image);
+            painter.setPen(QPen(Qt::darkBlue, 8));
+            painter.drawEllipse(image.rect().adjusted(40, 40, -40, -40));
+        }
+        imagePath = dir.filePath("bench.png");
+        image.save(imagePath);
+
+        waveform.resize(10000000);
+        for (int i = 0; i < waveform.size(); ++i) {
+            waveform[i] = static_cast<float>(std::sin(i * 0.0245) + 0.1 * std::sin(i * 0.731));
+        }
+        if (!selfCheck()) {
+            return 1;
+        }
+
+        for (const bool landscape: {false, true}) {
+            text(landscape);
+            tables(landscape);
+        }
+        cells();
+        reports();
+        processing();
+        return 0;
+    }
+};
+#endif
+
 int main(int argc, char *argv[]) {
     qInstallMessageHandler(myMessageHandler);
+#ifdef REPORT_BENCHMARK
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    const QGuiApplication app(argc, argv);
+    debug = false;
+    return Benchmark().exec(QGuiApplication::arguments());
+#endif
+    for (int i = 1; i < argc; ++i) {
+        // --batch <файл> или --batch=<файл>, как принимает QCommandLineParser
+        if (qstrcmp(argv[i], "--batch") == 0 || qstrncmp(argv[i], "--batch=", 8) == 0) {
+            // Без дисплея: платформа offscreen, достаточно QGuiApplication
+            if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+                qputenv("QT_QPA_PLATFORM", "offscreen");
+            }
+            const QGuiApplication app(argc, argv);
+            return runBatch(QGuiApplication::arguments());
+        }
+    }
     QApplication app(argc, argv);
     PdfPrinter window;
     window.show();